@@ -1,17 +1,53 @@
+#include <time.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86
+#endif
+
+#include "memori.h"
 
 #define MEMORI_VERSION "0.0.1"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+/*
+    Largest file `--populate` prefaults in one go. Above this, faulting the
+    whole file in up front costs more than it saves and can push everything
+    else out of the page cache.
+*/
+#define POPULATE_MAX_SIZE (1L << 30)
+
+/* How long a message stays in the message bar. */
+#define STATUS_MESSAGE_SECONDS 5
+
 enum EditorKey {
+    BACKSPACE = 127,
     ARROW_LEFT = 1000,
     ARROW_RIGHT,
     ARROW_UP,
@@ -23,11 +59,66 @@ enum EditorKey {
     DELETE_KEY
 };
 
-/* Editor Row */
-typedef struct erow {
+/* Plugins are told of keys by `enum MemoriKey`, which has to agree. */
+_Static_assert(BACKSPACE == (int) MEMORI_KEY_BACKSPACE && ARROW_LEFT == (int) MEMORI_KEY_ARROW_LEFT &&
+               ARROW_RIGHT == (int) MEMORI_KEY_ARROW_RIGHT && ARROW_UP == (int) MEMORI_KEY_ARROW_UP &&
+               ARROW_DOWN == (int) MEMORI_KEY_ARROW_DOWN && PAGE_UP == (int) MEMORI_KEY_PAGE_UP &&
+               PAGE_DOWN == (int) MEMORI_KEY_PAGE_DOWN && HOME_KEY == (int) MEMORI_KEY_HOME &&
+               END_KEY == (int) MEMORI_KEY_END && DELETE_KEY == (int) MEMORI_KEY_DELETE,
+               "enum EditorKey and enum MemoriKey disagree");
+
+/*
+    Editor rows, stored as parallel arrays indexed by row number.
+
+    Most passes over the rows need one or two of these columns, not all of
+    them: drawing looks at sizes, readahead at offsets and sizes, eviction
+    at chars. Keeping each column contiguous means such a pass only pulls
+    the bytes it uses through the cache, and there is no padding between
+    the fields of a row.
+*/
+struct Rows {
+    int *size;
+
+    /*
+        Where the row starts in the backing file, or -1 for a row that only
+        exists in memory: one inserted, reflowed, or received on attach.
+        A row's chars are dropped and read back from its offset only when
+        it has one and isn't `ROW_DIRTY`; edited rows are dirty until
+        saved, so they are never evicted. `chars` is NULL while the row is
+        evicted.
+    */
+    off_t *offset;
+    char **chars;
+
+    /* `ROW_*` flags. */
+    unsigned char *flags;
+};
+
+enum RowFlag {
+    /* `chars` is shared through the intern table, not owned by the row. */
+    ROW_INTERNED = 1 << 0,
+    /* Changed since the last save: the file no longer has these chars. */
+    ROW_DIRTY = 1 << 1
+};
+
+enum EditorMode {
+    MODE_NORMAL,
+    MODE_INSERT
+};
+
+/*
+    The on-disk bytes of a row as they were before its first edit.
+
+    Saving writes over the file in place, so before doing that we check
+    each chunk we are about to overwrite still holds what we loaded. Chunks
+    are keyed by file offset rather than row number, which shifts as rows
+    are inserted and deleted.
+*/
+struct DirtyChunk {
+    off_t offset;
     int size;
-    char *chars;
-} erow;
+    uint64_t hash;
+};
 
 /* Global editor configurations */
 struct EditorConfig {
@@ -36,18 +127,88 @@ struct EditorConfig {
     int screenRows;
     int screenCols;
 
+    /* Index of the first file row and column shown on the screen. */
+    int rowOff;
+    int colOff;
+
+    int mode;
+
     int numRows;
-    erow row;
+    int rowCap;
+    struct Rows row;
+
+    /*
+        With a shared index (see `Index_load`), `row.size` and `row.offset`
+        point into `indexMap`, a private mapping of the index cache file,
+        until the table has to grow or be freed.
+    */
+    char *indexMap;
+    size_t indexMapSize;
+    int shareIndex;
+
+    char *filename;
+    int fd;
 
-    /* Original terminal state. */
+    /*
+        What saving needs to know. `dirty` counts the rows changed since the
+        last save. `shiftedFrom` is the first row inserted or deleted since,
+        or `INT_MAX`. `fileStat` is the file as of the last load or save, to
+        tell whether someone else changed it since.
+    */
+    int dirty;
+    int shiftedFrom;
+    struct DirtyChunk *dirtyChunks;
+    int numDirtyChunks;
+    int capDirtyChunks;
+    struct stat fileStat;
+
+    /* Line endings rows are written with, and whether the file ends with one. */
+    int crlf;
+    int trailingNewline;
+
+    /*
+        Memory budget. With `--max-memory`, the row table and the row chars
+        must fit in `maxMemory` bytes: rows that don't fit are left in the
+        file and read back when they are drawn, evicting others.
+    */
+    size_t maxMemory;
+    int evictHand;
+    int pressureFd;
+
+    /* Set by `--hugepages`, `--populate` and `--intern`. */
+    int hugePages;
+    int populate;
+    int intern;
+
+    /*
+        Scrolling state used to read ahead of the viewport: where the
+        viewport was on the last frame, how fast it has been moving (rows per
+        frame, smoothed) and the rows already handed to the kernel.
+    */
+    int lastRowOff;
+    int scrollSpeed;
+    int readaheadFrom, readaheadTo;
+
+    /* Message shown at the bottom line, cleared after a few seconds. */
+    char statusMessage[80];
+    time_t statusMessageTime;
+
+    /* Original terminal state, and whether we switched it to raw mode. */
     struct termios terminal;
+    int rawMode;
 };
 
 struct EditorConfig editorConfig;
 
+int Editor_waitForInput(void);
+void Editor_redraw(void);
+void Collab_stop(void);
+
 void Terminal_die(const char *message) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if (editorConfig.rawMode) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
 
     perror(message);
     exit(1);
@@ -122,13 +283,62 @@ void Terminal_enableRawMode(void) {
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         Terminal_die("tcsetattr");
     }
+
+    editorConfig.rawMode = 1;
+}
+
+/*
+    Bytes read ahead of `Terminal_readKey` by `Terminal_pollCancel`, which
+    gets them before new input.
+*/
+char typeAhead[64];
+int typeAheadLen = 0;
+
+int Terminal_readByte(char *c) {
+    if (typeAheadLen > 0) {
+        *c = typeAhead[0];
+        memmove(typeAhead, typeAhead + 1, --typeAheadLen);
+        return 1;
+    }
+
+    return read(STDIN_FILENO, c, 1);
+}
+
+/*
+    Without blocking, look for `ESC` or `Ctrl-C` in what was typed. Other
+    keys are kept for `Terminal_readKey`, and an `ESC` starting an escape
+    sequence (an arrow key, say) doesn't count.
+*/
+int Terminal_pollCancel(void) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    while (typeAheadLen < (int) sizeof(typeAhead) && poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (read(STDIN_FILENO, &typeAhead[typeAheadLen], 1) != 1) break;
+        typeAheadLen++;
+    }
+
+    for (int i = 0; i < typeAheadLen; i++) {
+        char c = typeAhead[i];
+        int sequence = i + 1 < typeAheadLen && (typeAhead[i + 1] == '[' || typeAhead[i + 1] == 'O');
+
+        if (c == CTRL_KEY('c') || (c == '\x1b' && !sequence)) {
+            memmove(&typeAhead[i], &typeAhead[i + 1], typeAheadLen - i - 1);
+            typeAheadLen--;
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 int Terminal_readKey(void) {
     int nread;
     char c;
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    // Sleep until a key comes, running timers and other deferred work
+    // meanwhile, so it never gets in the way of keystrokes.
+    while (typeAheadLen == 0 && !Editor_waitForInput()) {}
+
+    while ((nread = Terminal_readByte(&c)) != 1) {
         if (nread == -1 && errno != EAGAIN) {
             Terminal_die("read");
         }
@@ -137,12 +347,12 @@ int Terminal_readKey(void) {
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return c;
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return c;
+        if (Terminal_readByte(&seq[0]) != 1) return c;
+        if (Terminal_readByte(&seq[1]) != 1) return c;
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return c;
+                if (Terminal_readByte(&seq[2]) != 1) return c;
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                     case '1':
@@ -235,207 +445,7010 @@ int Terminal_getWindowSize(int *rows, int *cols) {
     return 0;
 }
 
-struct AppendBuffer {
-    char *buf;
-    int len;
+/* Timers */
+
+/*
+    Deferred work (redrawing when the message expires, computing the
+    overview) runs from a hierarchical timer wheel, while waiting for input.
+
+    Time goes in ticks of `TIMER_TICK_MS`. Level 0 has a slot per tick for
+    the next 256 ticks, and each level above has 64 slots, each as long as
+    a whole turn of the level below. A timer sits in the slot of the lowest
+    level its expiry fits in, and moves down a level when that level's turn
+    comes around. Adding, cancelling and running a timer are O(1).
+*/
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL0_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS ((1 << TIMER_LEVEL0_BITS) + (TIMER_LEVELS - 1) * (1 << TIMER_LEVEL_BITS))
+
+struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    /* Tick the timer runs at, and the slot it sits in until then. */
+    uint64_t expires;
+    int slot;
+    void (*fn)(void);
+    int armed;
 };
 
-#define APPEND_BUFFER_INIT {NULL, 0}
+struct TimerWheel {
+    /* Last tick that ran. */
+    uint64_t now;
+    int started;
+    int numTimers;
+    struct Timer *slots[TIMER_SLOTS];
+};
 
-void AppendBuffer_append(struct AppendBuffer *ab, const char *s, int len) {
-    char *new = realloc(ab->buf, ab->len + len);
-    if (!new) return;
+struct TimerWheel timerWheel;
 
-    memcpy(&new[ab->len], s, len);
-    ab->buf = new;
-    ab->len += len;
+uint64_t Timer_currentTick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
 }
 
-void AppendBuffer_free(struct AppendBuffer *ab) {
-    free(ab->buf);
+/* Bits of a tick below level `level`. */
+int Timer_shift(int level) {
+    return level == 0 ? 0 : TIMER_LEVEL0_BITS + (level - 1) * TIMER_LEVEL_BITS;
 }
 
-/*
-    Open a file in the editor.
-*/
-void Editor_open(char *path) {
-    FILE *fp = fopen(path, "r");
-    if (!fp) Terminal_die("fopen");
+/* Index in `slots` of the slot of `level` that `tick` falls in. */
+int Timer_slot(int level, uint64_t tick) {
+    if (level == 0) return tick & ((1 << TIMER_LEVEL0_BITS) - 1);
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen = getline(&line, &linecap, fp);
-    if (linelen != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\r' || line[linelen - 1] == '\n')) {
-            linelen--;
-        }
+    return (1 << TIMER_LEVEL0_BITS) + (level - 1) * (1 << TIMER_LEVEL_BITS) +
+           ((tick >> Timer_shift(level)) & ((1 << TIMER_LEVEL_BITS) - 1));
+}
 
-        editorConfig.row.size = linelen;
-        editorConfig.row.chars = (char *) malloc(linelen + 1);
-        memcpy(editorConfig.row.chars, line, linelen);
+void Timer_insert(struct Timer *timer) {
+    uint64_t delta = timer->expires - timerWheel.now;
+    uint64_t tick = timer->expires;
 
-        editorConfig.row.chars[linelen] = '\0';
-        editorConfig.numRows = 1;
-    }
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (uint64_t) 1 << Timer_shift(level + 1)) level++;
 
-    free(line);
-    fclose(fp);
+    // Further than the wheel reaches: park it in the last slot, it is
+    // placed again when that slot's turn comes.
+    uint64_t reach = (uint64_t) 1 << (Timer_shift(TIMER_LEVELS - 1) + TIMER_LEVEL_BITS);
+    if (delta >= reach) tick = timerWheel.now + reach - 1;
+
+    timer->slot = Timer_slot(level, tick);
+    struct Timer **slot = &timerWheel.slots[timer->slot];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) (*slot)->prev = timer;
+    *slot = timer;
 }
 
-void Editor_processMoveCursor(int key) {
-    switch (key) {
-    case 'k':
-    case ARROW_UP:
-        if (editorConfig.cy > 0) editorConfig.cy--;
-        break;
-    case 'j':
-    case ARROW_DOWN:
-        if (editorConfig.cy < editorConfig.screenRows - 1) editorConfig.cy++;
-        break;
-    case 'l':
-    case ARROW_RIGHT:
-        if (editorConfig.cx < editorConfig.screenCols - 1) editorConfig.cx++;
-        break;
-    case 'h':
-    case ARROW_LEFT:
-        if (editorConfig.cx > 0) editorConfig.cx--;
-        break;
+void Timer_cancel(struct Timer *timer) {
+    if (!timer->armed) return;
+
+    if (timer->prev) timer->prev->next = timer->next;
+    else timerWheel.slots[timer->slot] = timer->next;
+    if (timer->next) timer->next->prev = timer->prev;
+
+    timer->armed = 0;
+    timerWheel.numTimers--;
+}
+
+/*
+    Run `fn` in `ms` milliseconds, or as soon as possible for 0. Adding an
+    armed timer moves it.
+*/
+void Timer_add(struct Timer *timer, int ms, void (*fn)(void)) {
+    if (!timerWheel.started) {
+        timerWheel.now = Timer_currentTick();
+        timerWheel.started = 1;
     }
+
+    Timer_cancel(timer);
+
+    uint64_t expires = Timer_currentTick() + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->expires = expires > timerWheel.now ? expires : timerWheel.now + 1;
+    timer->fn = fn;
+    timer->armed = 1;
+    timerWheel.numTimers++;
+    Timer_insert(timer);
 }
 
-void Editor_processKey(void) {
-    int key = Terminal_readKey();
+void Timer_runTick(uint64_t tick) {
+    timerWheel.now = tick;
 
-    switch (key) {
-    case CTRL_KEY('q'):
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+    /*
+        Level 0 wrapped around: move the timers of the slot whose turn came
+        on level 1 down, and so on up as long as that level wrapped too.
+        They always land on a lower level, never back in the slot.
+    */
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if (tick & (((uint64_t) 1 << Timer_shift(level)) - 1)) break;
 
-        exit(0);
-        break;
+        int index = Timer_slot(level, tick);
+        struct Timer *t = timerWheel.slots[index];
+        timerWheel.slots[index] = NULL;
 
-    case PAGE_UP:
-    case PAGE_DOWN:
-        {
-            int times = editorConfig.screenRows;
-            while (times--) {
-                Editor_processMoveCursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-            }
+        while (t) {
+            struct Timer *next = t->next;
+            Timer_insert(t);
+            t = next;
         }
-        break;
-    
-    case HOME_KEY:
-        editorConfig.cx = 0;
-        break;
-
-    case END_KEY:
-        editorConfig.cx = editorConfig.screenCols - 1;
-        break;
+    }
 
-    case 'k':
-    case 'j':
-    case 'l':
-    case 'h':
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_RIGHT:
-    case ARROW_LEFT:
-        Editor_processMoveCursor(key);
-        break;
+    // Taken one at a time, so a timer can cancel or add others as it runs.
+    struct Timer *t;
+    while ((t = timerWheel.slots[Timer_slot(0, tick)])) {
+        Timer_cancel(t);
+        t->fn();
     }
 }
 
-void Editor_drawRows(struct AppendBuffer *ab) {
-    for (int y = 0; y < editorConfig.screenRows; y++) {
-        if (y < editorConfig.numRows) {
-            int len = editorConfig.row.size;
-            if (len > editorConfig.screenCols) {
-                len = editorConfig.screenCols;
-            }
-
-            AppendBuffer_append(ab, editorConfig.row.chars, len);
-        } else if (y == editorConfig.screenRows / 3) {
-            char welcome[80];
-            int welcomeLen = snprintf(welcome, sizeof(welcome), "Memori editor -- version %s", MEMORI_VERSION);
+/*
+    Run every timer that is due.
+*/
+void Timer_run(void) {
+    if (!timerWheel.started) return;
 
-            if (welcomeLen > editorConfig.screenCols) {
-                welcomeLen = editorConfig.screenCols;
-            }
+    uint64_t current = Timer_currentTick();
+    if (timerWheel.numTimers == 0 && current > timerWheel.now) timerWheel.now = current;
 
-            int padding = (editorConfig.screenCols - welcomeLen) / 2;
-            if (padding) {
-                AppendBuffer_append(ab, "~", 1);
-                padding--;
-            }
+    while (timerWheel.now < current && timerWheel.numTimers > 0) {
+        Timer_runTick(timerWheel.now + 1);
+    }
+    if (timerWheel.now < current) timerWheel.now = current;
+}
 
-            while (padding--) AppendBuffer_append(ab, " ", 1);
+/*
+    Milliseconds until the next timer is due, or -1 without timers. For a
+    timer on a level above 0, this is when its slot moves down a level.
+*/
+int Timer_timeout(void) {
+    if (timerWheel.numTimers == 0) return -1;
 
-            AppendBuffer_append(ab, welcome, welcomeLen);
-        } else {
-            AppendBuffer_append(ab, "~", 1);
-        }
+    uint64_t due = 0;
+    for (int level = 0; level < TIMER_LEVELS && !due; level++) {
+        int shift = Timer_shift(level);
+        int slots = 1 << (level == 0 ? TIMER_LEVEL0_BITS : TIMER_LEVEL_BITS);
 
-        // The `K` (Erase In Line) escape sequence. With default argument (0), 
-        // it erase the whole line after cursor
-        AppendBuffer_append(ab, "\x1b[K", 3);
-        if (y < editorConfig.screenRows - 1) {
-            AppendBuffer_append(ab, "\r\n", 2);
+        for (int k = 1; k <= slots && !due; k++) {
+            uint64_t tick = ((timerWheel.now >> shift) + k) << shift;
+            if (timerWheel.slots[Timer_slot(level, tick)]) due = tick;
         }
     }
+
+    uint64_t current = Timer_currentTick();
+    if (!due || due <= current) return 0;
+    return (due - current) * TIMER_TICK_MS;
 }
 
+struct Timer statusMessageTimer;
+
 /*
-    Refresh the screen on every render.
+    Show a message in the message bar. A timer redraws once it expired.
+*/
+void Editor_setStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(editorConfig.statusMessage, sizeof(editorConfig.statusMessage), fmt, ap);
+    va_end(ap);
 
-    The refresh steps are:
+    editorConfig.statusMessageTime = time(NULL);
+    Timer_add(&statusMessageTimer, STATUS_MESSAGE_SECONDS * 1000, Editor_redraw);
+}
 
-    1. it hides the cursor with the `l` (Set Mode) espace sequence and 
-    set cursor position to the top;
-    2. Draw all rows;
-    3. Go back to the top and shows the cursor with `h` (Reset Mode) escape sequence.
+/* Memory accounting */
+
+/*
+    Every long-lived allocation is tagged with the subsystem it belongs to,
+    so we can tell where the memory goes without an external profiler.
+
+    The wrappers take the size of the block being freed or resized instead
+    of storing it in a header: callers always know it, and a header would
+    cost more than a short row.
 */
-void Editor_refreshScreen(void) {
-    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+enum MemoryTag {
+    MEMORY_ROWS,
+    MEMORY_ROW_CHARS,
+    MEMORY_APPEND_BUFFER,
+    MEMORY_PICKER,
+    MEMORY_SYMBOLS,
+    MEMORY_INTERN,
+    MEMORY_DIRTY,
+    MEMORY_OVERVIEW,
+    MEMORY_SPELL,
+    MEMORY_DECORATIONS,
+    MEMORY_PLUGINS,
+    MEMORY_COLLAB,
+    MEMORY_TAG_COUNT
+};
 
-    AppendBuffer_append(&ab, "\x1b[?25l", 6);
-    AppendBuffer_append(&ab, "\x1b[H", 3);
+static const char *memoryTagNames[MEMORY_TAG_COUNT] = {
+    "rows", "chars", "frames", "picker", "symbols", "intern", "dirty", "overview", "spell",
+    "decorations", "plugins", "collab"
+};
 
-    Editor_drawRows(&ab);
+struct MemoryStats {
+    size_t live;
+    size_t peak;
+    /* Number of allocations made so far. */
+    size_t count;
+};
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorConfig.cy + 1, editorConfig.cx + 1);
-    AppendBuffer_append(&ab, buf, strlen(buf));
+struct MemoryStats memoryStats[MEMORY_TAG_COUNT];
 
-    AppendBuffer_append(&ab, "\x1b[?25h", 6);
+volatile sig_atomic_t memoryDumpRequested = 0;
 
-    write(STDOUT_FILENO, ab.buf, ab.len);
-    AppendBuffer_free(&ab);
+void Memory_account(enum MemoryTag tag, size_t oldSize, size_t newSize) {
+    struct MemoryStats *stats = &memoryStats[tag];
+
+    stats->live = stats->live - oldSize + newSize;
+    if (stats->live > stats->peak) stats->peak = stats->live;
 }
 
-void Editor_init(void) {
-    editorConfig.cx = 0;
-    editorConfig.cy = 0;
-    editorConfig.numRows = 0;
+void *Memory_alloc(enum MemoryTag tag, size_t size) {
+    void *p = malloc(size);
+    if (!p) return NULL;
 
-    if (Terminal_getWindowSize(&editorConfig.screenRows, &editorConfig.screenCols) == -1) {
-        Terminal_die("getWindowSize");
-    }
+    memoryStats[tag].count++;
+    Memory_account(tag, 0, size);
+    return p;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("usage: %s <file>\n", argv[0]);
-        return 0;
+void *Memory_realloc(enum MemoryTag tag, void *p, size_t oldSize, size_t newSize) {
+    void *new = realloc(p, newSize);
+    if (!new) return NULL;
+
+    if (!p) memoryStats[tag].count++;
+    Memory_account(tag, oldSize, newSize);
+    return new;
+}
+
+char *Memory_strdup(enum MemoryTag tag, const char *s) {
+    size_t size = strlen(s) + 1;
+
+    char *p = Memory_alloc(tag, size);
+    if (p) memcpy(p, s, size);
+    return p;
+}
+
+void Memory_free(enum MemoryTag tag, void *p, size_t size) {
+    if (!p) return;
+
+    free(p);
+    Memory_account(tag, size, 0);
+}
+
+/*
+    Format a byte count the way humans read it: `512B`, `3.2K`, `1.5M`.
+*/
+void Memory_formatSize(char *buf, size_t cap, size_t n) {
+    static const char units[] = "BKMGT";
+
+    double size = n;
+    int unit = 0;
+    while (size >= 1024 && units[unit + 1]) {
+        size /= 1024;
+        unit++;
     }
 
-    Terminal_enableRawMode();
-    Editor_init();
-    Editor_open(argv[1]);
+    if (unit == 0) snprintf(buf, cap, "%zuB", n);
+    else snprintf(buf, cap, "%.1f%c", size, units[unit]);
+}
 
-    while(1) {
-        Editor_refreshScreen();
-        Editor_processKey();
+void Memory_handleSignal(int sig) {
+    (void) sig;
+    memoryDumpRequested = 1;
+}
+
+/*
+    Write the statistics of every tag to `fp`, one tag per line.
+*/
+void Memory_dump(FILE *fp) {
+    fprintf(fp, "%-11s %10s %10s %10s\n", "tag", "live", "peak", "count");
+
+    for (int i = 0; i < MEMORY_TAG_COUNT; i++) {
+        char live[16], peak[16];
+        Memory_formatSize(live, sizeof(live), memoryStats[i].live);
+        Memory_formatSize(peak, sizeof(peak), memoryStats[i].peak);
+
+        fprintf(fp, "%-11s %10s %10s %10zu\n", memoryTagNames[i], live, peak, memoryStats[i].count);
     }
+}
 
-    return 0;
-}
\ No newline at end of file
+struct AppendBuffer {
+    char *buf;
+    int len;
+};
+
+#define APPEND_BUFFER_INIT {NULL, 0}
+
+void AppendBuffer_append(struct AppendBuffer *ab, const char *s, int len) {
+    char *new = Memory_realloc(MEMORY_APPEND_BUFFER, ab->buf, ab->len, ab->len + len);
+    if (!new) return;
+
+    memcpy(&new[ab->len], s, len);
+    ab->buf = new;
+    ab->len += len;
+}
+
+void AppendBuffer_free(struct AppendBuffer *ab) {
+    Memory_free(MEMORY_APPEND_BUFFER, ab->buf, ab->len);
+}
+
+/* Progress */
+
+/*
+    Long operations call `Progress_update` as they go. Every 20ms it looks
+    for `ESC` or `Ctrl-C` in the input, and every 100ms redraws the message
+    bar with how far the operation got. Once cancelled it returns nonzero
+    and the operation stops, leaving things as they were if it can. An
+    operation that can't stop halfway (writing over the file) is started
+    with `cancellable` off and only shows its progress.
+
+    Outside raw mode (`--train`), nothing is drawn or read.
+*/
+#define PROGRESS_POLL_NS 20000000L
+#define PROGRESS_DRAW_NS 100000000L
+
+struct Progress {
+    const char *what;
+    /* Units of work in all, or 0 when unknown. */
+    long long total;
+    int cancellable;
+    int cancelled;
+    int drawn;
+
+    struct timespec start;
+    struct timespec lastPoll;
+    struct timespec lastDraw;
+};
+
+struct Progress progress;
+
+long Progress_since(const struct timespec *then, const struct timespec *now) {
+    return (now->tv_sec - then->tv_sec) * 1000000000L + (now->tv_nsec - then->tv_nsec);
+}
+
+void Progress_begin(const char *what, long long total, int cancellable) {
+    progress.what = what;
+    progress.total = total;
+    progress.cancellable = cancellable;
+    progress.cancelled = 0;
+    progress.drawn = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &progress.start);
+    progress.lastPoll = progress.lastDraw = progress.start;
+}
+
+void Progress_draw(long long done) {
+    char msg[sizeof(editorConfig.statusMessage)];
+    int len = progress.total > 0
+        ? snprintf(msg, sizeof(msg), "%s... %lld%%", progress.what, done * 100 / progress.total)
+        : snprintf(msg, sizeof(msg), "%s... %lld", progress.what, done);
+    if (progress.cancellable && len < (int) sizeof(msg)) {
+        len += snprintf(&msg[len], sizeof(msg) - len, " (Esc to cancel)");
+    }
+    if (len >= (int) sizeof(msg)) len = sizeof(msg) - 1;
+    if (len > editorConfig.screenCols) len = editorConfig.screenCols;
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    char pos[32];
+    int posLen = snprintf(pos, sizeof(pos), "\x1b[%d;1H\x1b[K", editorConfig.screenRows + 1);
+    AppendBuffer_append(&ab, pos, posLen);
+    AppendBuffer_append(&ab, msg, len);
+    write(STDOUT_FILENO, ab.buf, ab.len);
+    AppendBuffer_free(&ab);
+
+    progress.drawn = 1;
+}
+
+/*
+    Report `done` units of work. Returns nonzero once the user cancelled.
+*/
+int Progress_update(long long done) {
+    if (!editorConfig.rawMode || progress.cancelled) return progress.cancelled;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (progress.cancellable && Progress_since(&progress.lastPoll, &now) >= PROGRESS_POLL_NS) {
+        progress.lastPoll = now;
+        progress.cancelled = Terminal_pollCancel();
+    }
+
+    if (Progress_since(&progress.lastDraw, &now) >= PROGRESS_DRAW_NS) {
+        progress.lastDraw = now;
+        Progress_draw(done);
+    }
+
+    return progress.cancelled;
+}
+
+/*
+    Finish the operation, returning whether it was cancelled.
+*/
+int Progress_end(void) {
+    if (progress.drawn) Editor_setStatusMessage("");
+    return progress.cancelled;
+}
+
+/* File picker */
+
+#define PICKER_QUERY_MAX 256
+
+struct PickerMatch {
+    int index;
+    int score;
+};
+
+struct Picker {
+    char **paths;
+    int numPaths;
+    int capPaths;
+
+    /* Candidates matching the current query, best first. */
+    struct PickerMatch *matches;
+    int numMatches;
+
+    char query[PICKER_QUERY_MAX];
+    int queryLen;
+    int selected;
+
+    /* Whether the picker is on the screen. */
+    int active;
+};
+
+struct Picker picker;
+
+void Picker_addPath(const char *path) {
+    if (picker.numPaths == picker.capPaths) {
+        int cap = picker.capPaths ? picker.capPaths * 2 : 1024;
+        char **new = Memory_realloc(MEMORY_PICKER, picker.paths,
+                                    sizeof(char *) * picker.capPaths, sizeof(char *) * cap);
+        if (!new) Terminal_die("realloc");
+
+        picker.paths = new;
+        picker.capPaths = cap;
+    }
+
+    picker.paths[picker.numPaths] = Memory_strdup(MEMORY_PICKER, path);
+    if (!picker.paths[picker.numPaths]) Terminal_die("strdup");
+    picker.numPaths++;
+}
+
+/*
+    Collect every regular file under `dir`.
+
+    Hidden entries (and with them `.git` and friends) are skipped. When the
+    filesystem doesn't fill `d_type`, we fall back to `lstat`, so symlinks are
+    never followed and a link cycle can't make the walk loop forever.
+*/
+void Picker_walk(const char *dir) {
+    DIR *dp = opendir(dir);
+    if (!dp) return;
+
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    while ((entry = readdir(dp)) != NULL && !Progress_update(picker.numPaths)) {
+        if (entry->d_name[0] == '.') continue;
+
+        int len = strcmp(dir, ".") == 0
+            ? snprintf(path, sizeof(path), "%s", entry->d_name)
+            : snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (len < 0 || len >= (int) sizeof(path)) continue;
+
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) == -1) continue;
+
+            if (S_ISDIR(st.st_mode)) type = DT_DIR;
+            else if (S_ISREG(st.st_mode)) type = DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            Picker_walk(path);
+        } else if (type == DT_REG) {
+            Picker_addPath(path);
+        }
+    }
+
+    closedir(dp);
+}
+
+/*
+    Add a command line argument to the picker: directories are walked and
+    regular files are taken as they are.
+*/
+void Picker_addArg(const char *arg) {
+    struct stat st;
+    if (stat(arg, &st) == -1) return;
+
+    if (S_ISDIR(st.st_mode)) {
+        char dir[PATH_MAX];
+        int len = snprintf(dir, sizeof(dir), "%s", arg);
+        if (len < 0 || len >= (int) sizeof(dir)) return;
+
+        while (len > 1 && dir[len - 1] == '/') dir[--len] = '\0';
+
+        Progress_begin("Listing files", 0, 1);
+        Picker_walk(dir);
+        if (Progress_end()) Editor_setStatusMessage("Listing cancelled after %d files", picker.numPaths);
+    } else if (S_ISREG(st.st_mode)) {
+        Picker_addPath(arg);
+    }
+}
+
+/*
+    Score `path` against the query as a case-insensitive subsequence.
+
+    Returns -1 when the query isn't a subsequence of the path. Otherwise every
+    matched character is worth a point, plus a bonus when it directly follows
+    the previous match or starts a path component or word, so `edo` ranks
+    `editor/open.c` above a path that only scatters the same letters around.
+*/
+int Picker_score(const char *path) {
+    int score = 0;
+    int prev = -2;
+    int q = 0;
+
+    for (int i = 0; path[i] && q < picker.queryLen; i++) {
+        if (tolower((unsigned char) path[i]) != tolower((unsigned char) picker.query[q])) {
+            continue;
+        }
+
+        score++;
+        if (i == prev + 1) score += 4;
+        if (i == 0 || strchr("/_-. ", path[i - 1])) score += 3;
+
+        prev = i;
+        q++;
+    }
+
+    return q == picker.queryLen ? score : -1;
+}
+
+int Picker_compareMatches(const void *a, const void *b) {
+    const struct PickerMatch *ma = a;
+    const struct PickerMatch *mb = b;
+
+    if (ma->score != mb->score) return mb->score - ma->score;
+
+    /* On a tie, the shorter path is the more specific one. */
+    return (int) strlen(picker.paths[ma->index]) - (int) strlen(picker.paths[mb->index]);
+}
+
+/*
+    Re-rank the candidates after the query changed.
+
+    When the query only grew, a path that didn't match before can't match now,
+    so `narrow` rescores just the current matches instead of every path. On a
+    big tree that turns each typed character into a pass over an ever smaller
+    set; only deleting a character has to go back to the full list.
+*/
+void Picker_filter(int narrow) {
+    if (!picker.matches) {
+        picker.matches = Memory_alloc(MEMORY_PICKER, sizeof(struct PickerMatch) * picker.numPaths);
+        if (!picker.matches) Terminal_die("malloc");
+    }
+
+    int n = 0;
+    if (narrow) {
+        for (int i = 0; i < picker.numMatches; i++) {
+            int score = Picker_score(picker.paths[picker.matches[i].index]);
+            if (score < 0) continue;
+
+            picker.matches[n].index = picker.matches[i].index;
+            picker.matches[n].score = score;
+            n++;
+        }
+    } else {
+        for (int i = 0; i < picker.numPaths; i++) {
+            int score = Picker_score(picker.paths[i]);
+            if (score < 0) continue;
+
+            picker.matches[n].index = i;
+            picker.matches[n].score = score;
+            n++;
+        }
+    }
+
+    picker.numMatches = n;
+    picker.selected = 0;
+    qsort(picker.matches, n, sizeof(struct PickerMatch), Picker_compareMatches);
+}
+
+void Picker_refreshScreen(void) {
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+
+    AppendBuffer_append(&ab, "\x1b[?25l", 6);
+    AppendBuffer_append(&ab, "\x1b[H", 3);
+
+    char status[80];
+    int statusLen = snprintf(status, sizeof(status), "> %.*s", editorConfig.screenCols, picker.query);
+    if (statusLen > editorConfig.screenCols) statusLen = editorConfig.screenCols;
+
+    AppendBuffer_append(&ab, status, statusLen);
+    AppendBuffer_append(&ab, "\x1b[K\r\n", 5);
+
+    for (int y = 1; y < editorConfig.screenRows; y++) {
+        int m = y - 1;
+        if (m < picker.numMatches) {
+            const char *path = picker.paths[picker.matches[m].index];
+            int len = strlen(path);
+            if (len > editorConfig.screenCols) len = editorConfig.screenCols;
+
+            // The `m` (Select Graphic Rendition) escape sequence with `7`
+            // inverts the colors of the selected candidate.
+            if (m == picker.selected) AppendBuffer_append(&ab, "\x1b[7m", 4);
+            AppendBuffer_append(&ab, path, len);
+            if (m == picker.selected) AppendBuffer_append(&ab, "\x1b[m", 3);
+        }
+
+        AppendBuffer_append(&ab, "\x1b[K", 3);
+        if (y < editorConfig.screenRows - 1) {
+            AppendBuffer_append(&ab, "\r\n", 2);
+        }
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[1;%dH", statusLen + 1);
+    AppendBuffer_append(&ab, buf, strlen(buf));
+
+    AppendBuffer_append(&ab, "\x1b[?25h", 6);
+
+    write(STDOUT_FILENO, ab.buf, ab.len);
+    AppendBuffer_free(&ab);
+}
+
+/*
+    Let the user pick one of the collected paths by typing a fuzzy query.
+
+    Returns the chosen path, or exits the editor if the picker is cancelled.
+*/
+char *Picker_run(void) {
+    if (picker.numPaths == 0) {
+        errno = ENOENT;
+        Terminal_die("picker");
+    }
+
+    Picker_filter(0);
+    picker.active = 1;
+
+    while (1) {
+        Picker_refreshScreen();
+
+        int key = Terminal_readKey();
+        switch (key) {
+        case '\r':
+            if (picker.numMatches > 0) {
+                picker.active = 0;
+                return picker.paths[picker.matches[picker.selected].index];
+            }
+            break;
+
+        case '\x1b':
+        case CTRL_KEY('q'):
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+
+            exit(0);
+            break;
+
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            if (picker.queryLen > 0) {
+                picker.query[--picker.queryLen] = '\0';
+                Picker_filter(0);
+            }
+            break;
+
+        case ARROW_UP:
+        case CTRL_KEY('p'):
+            if (picker.selected > 0) picker.selected--;
+            break;
+
+        case ARROW_DOWN:
+        case CTRL_KEY('n'):
+            if (picker.selected < picker.numMatches - 1 &&
+                picker.selected < editorConfig.screenRows - 2) {
+                picker.selected++;
+            }
+            break;
+
+        default:
+            if (key < 128 && isprint(key) && picker.queryLen < PICKER_QUERY_MAX - 1) {
+                picker.query[picker.queryLen++] = key;
+                picker.query[picker.queryLen] = '\0';
+                Picker_filter(1);
+            }
+            break;
+        }
+    }
+}
+
+/* CPU dispatch */
+
+/*
+    Kernels that have vector versions are called through `cpu`, bound once
+    by `Cpu_init` to the best version the host supports. The binary is built
+    for the baseline, and the wider versions are compiled with `target`
+    attributes, so they only ever run where `Cpu_init` found the feature.
+
+    `--cpu <level>` caps the level (`--cpu scalar` forces the portable C
+    versions), and `--cpu-features` prints what was detected and chosen.
+*/
+enum CpuLevel {
+    CPU_SCALAR,
+    CPU_SSE2,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_LEVEL_COUNT
+};
+
+const char *cpuLevelNames[CPU_LEVEL_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+
+/*
+    What `cpu.classify` finds in a block of 64 bytes: bit `i` of each mask
+    says whether byte `i` is a newline, whitespace (space, `\t` to `\r`),
+    or a UTF-8 continuation byte (`10xxxxxx`).
+*/
+struct CpuMasks {
+    uint64_t newline;
+    uint64_t space;
+    uint64_t continuation;
+};
+
+/*
+    What `cpu.wordClasses` finds in a block of 64 bytes: bit `i` of each
+    mask says whether byte `i` is a word character (letter, digit, `_`, or
+    any byte of a non-ASCII character) or whitespace. Bytes in neither are
+    punctuation.
+*/
+struct CpuClasses {
+    uint64_t word;
+    uint64_t space;
+};
+
+/*
+    What `cpu.jsonClasses` finds in a block of 64 bytes: bit `i` of each
+    mask says whether byte `i` is a quote, a backslash, JSON whitespace
+    (space, `\t`, `\n` or `\r`), a bracket (`{}[]`) or a separator (`,:`).
+*/
+struct CpuJson {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t space;
+    uint64_t bracket;
+    uint64_t separator;
+};
+
+struct Cpu {
+    enum CpuLevel detected;
+    enum CpuLevel level;
+
+    void (*classify)(const char *s, struct CpuMasks *masks);
+    void (*wordClasses)(const char *s, struct CpuClasses *classes);
+    void (*jsonClasses)(const char *s, struct CpuJson *classes);
+};
+
+struct Cpu cpu;
+
+int Cpu_isSpace(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+void Cpu_classifyScalar(const char *s, struct CpuMasks *masks) {
+    *masks = (struct CpuMasks) {0, 0, 0};
+
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = s[i];
+        masks->newline |= (uint64_t) (c == '\n') << i;
+        masks->space |= (uint64_t) Cpu_isSpace(c) << i;
+        masks->continuation |= (uint64_t) ((c & 0xc0) == 0x80) << i;
+    }
+}
+
+int Cpu_isWord(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+void Cpu_wordClassesScalar(const char *s, struct CpuClasses *classes) {
+    *classes = (struct CpuClasses) {0, 0};
+
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = s[i];
+        classes->word |= (uint64_t) Cpu_isWord(c) << i;
+        classes->space |= (uint64_t) Cpu_isSpace(c) << i;
+    }
+}
+
+int Cpu_isJsonSpace(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+void Cpu_jsonClassesScalar(const char *s, struct CpuJson *classes) {
+    *classes = (struct CpuJson) {0, 0, 0, 0, 0};
+
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = s[i];
+        classes->quote |= (uint64_t) (c == '"') << i;
+        classes->backslash |= (uint64_t) (c == '\\') << i;
+        classes->space |= (uint64_t) Cpu_isJsonSpace(c) << i;
+        classes->bracket |= (uint64_t) ((c | 0x20) == '{' || (c | 0x20) == '}') << i;
+        classes->separator |= (uint64_t) (c == ',' || c == ':') << i;
+    }
+}
+
+#ifdef CPU_X86
+/*
+    Whitespace is a space or `c - '\t' <= 4` unsigned, which is when the
+    unsigned minimum of `c - '\t'` and 4 is `c - '\t'` itself. Continuation
+    bytes are the only ones below `0xc0` as signed bytes.
+*/
+__attribute__((target("sse2")))
+void Cpu_classifySse2(const char *s, struct CpuMasks *masks) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i lead = _mm_set1_epi8((char) 0xc0);
+    *masks = (struct CpuMasks) {0, 0, 0};
+
+    for (int i = 0; i < 64; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i control = _mm_sub_epi8(chunk, tab);
+        __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(control, four), control));
+
+        masks->newline |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)) << i;
+        masks->space |= (uint64_t) (uint16_t) _mm_movemask_epi8(isSpace) << i;
+        masks->continuation |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmplt_epi8(chunk, lead)) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+void Cpu_classifyAvx2(const char *s, struct CpuMasks *masks) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i lead = _mm256_set1_epi8((char) 0xc0);
+    *masks = (struct CpuMasks) {0, 0, 0};
+
+    for (int i = 0; i < 64; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i control = _mm256_sub_epi8(chunk, tab);
+        __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                          _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control));
+
+        masks->newline |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)) << i;
+        masks->space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(isSpace) << i;
+        masks->continuation |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(lead, chunk)) << i;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void Cpu_classifyAvx512(const char *s, struct CpuMasks *masks) {
+    __m512i chunk = _mm512_loadu_si512(s);
+
+    masks->newline = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n'));
+    masks->space = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(' ')) |
+                   _mm512_cmple_epu8_mask(_mm512_sub_epi8(chunk, _mm512_set1_epi8('\t')), _mm512_set1_epi8(4));
+    masks->continuation = _mm512_cmplt_epi8_mask(chunk, _mm512_set1_epi8((char) 0xc0));
+}
+
+/*
+    Word classes for SSE2, which has no byte shuffle: digits and letters
+    are unsigned ranges (letters after folding case with `| 0x20`), and
+    non-ASCII bytes are the negative ones.
+*/
+__attribute__((target("sse2")))
+void Cpu_wordClassesSse2(const char *s, struct CpuClasses *classes) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i a = _mm_set1_epi8('a');
+    const __m128i z = _mm_set1_epi8(25);
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i underscore = _mm_set1_epi8('_');
+    *classes = (struct CpuClasses) {0, 0};
+
+    for (int i = 0; i < 64; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i control = _mm_sub_epi8(chunk, tab);
+        __m128i digit = _mm_sub_epi8(chunk, zero);
+        __m128i letter = _mm_sub_epi8(_mm_or_si128(chunk, fold), a);
+        __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(control, four), control));
+        __m128i isWord = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit),
+                                                   _mm_cmpeq_epi8(_mm_min_epu8(letter, z), letter)),
+                                      _mm_cmpeq_epi8(chunk, underscore));
+
+        classes->word |= (uint64_t) (uint16_t) (_mm_movemask_epi8(isWord) | _mm_movemask_epi8(chunk)) << i;
+        classes->space |= (uint64_t) (uint16_t) _mm_movemask_epi8(isSpace) << i;
+    }
+}
+
+/*
+    Nibble lookup tables for the byte shuffles: a byte's classes are the
+    bits set in both the entry of its high nibble and of its low nibble.
+    Each bit stands for one run of low nibbles under one or more high
+    nibbles (`0x30`-`0x39`, `0x41`-`0x4f` and `0x61`-`0x6f`, `0x50`-`0x5a`
+    and `_`, `0x70`-`0x7a`, `0x80`-`0xff`), and the two top bits for `\t`
+    to `\r` and the space.
+*/
+#define CPU_CLASS_WORD 0x1f
+#define CPU_CLASS_SPACE 0x60
+
+#define CPU_CLASS_LOW \
+    0x5d, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, 0x1f, \
+    0x1f, 0x3f, 0x3e, 0x32, 0x32, 0x32, 0x12, 0x16
+
+#define CPU_CLASS_HIGH \
+    0x20, 0x00, 0x40, 0x01, 0x02, 0x04, 0x02, 0x08, \
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+
+__attribute__((target("avx2")))
+void Cpu_wordClassesAvx2(const char *s, struct CpuClasses *classes) {
+    const __m256i low = _mm256_setr_epi8(CPU_CLASS_LOW, CPU_CLASS_LOW);
+    const __m256i high = _mm256_setr_epi8(CPU_CLASS_HIGH, CPU_CLASS_HIGH);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i word = _mm256_set1_epi8(CPU_CLASS_WORD);
+    const __m256i space = _mm256_set1_epi8(CPU_CLASS_SPACE);
+    const __m256i none = _mm256_setzero_si256();
+    *classes = (struct CpuClasses) {0, 0};
+
+    for (int i = 0; i < 64; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i bits = _mm256_and_si256(
+            _mm256_shuffle_epi8(low, _mm256_and_si256(chunk, nibble)),
+            _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble)));
+
+        classes->word |= (uint64_t) (uint32_t) ~_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_and_si256(bits, word), none)) << i;
+        classes->space |= (uint64_t) (uint32_t) ~_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_and_si256(bits, space), none)) << i;
+    }
+}
+
+/*
+    The JSON classes are a handful of exact bytes, so plain compares do;
+    `[` and `]` are `{` and `}` with bit 5 clear.
+*/
+__attribute__((target("sse2")))
+void Cpu_jsonClassesSse2(const char *s, struct CpuJson *classes) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i colon = _mm_set1_epi8(':');
+    *classes = (struct CpuJson) {0, 0, 0, 0, 0};
+
+    for (int i = 0; i < 64; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i folded = _mm_or_si128(chunk, fold);
+        __m128i isSpace = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, cr)));
+        __m128i bracket = _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close));
+        __m128i separator = _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, colon));
+
+        classes->quote |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)) << i;
+        classes->backslash |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)) << i;
+        classes->space |= (uint64_t) (uint16_t) _mm_movemask_epi8(isSpace) << i;
+        classes->bracket |= (uint64_t) (uint16_t) _mm_movemask_epi8(bracket) << i;
+        classes->separator |= (uint64_t) (uint16_t) _mm_movemask_epi8(separator) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+void Cpu_jsonClassesAvx2(const char *s, struct CpuJson *classes) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i colon = _mm256_set1_epi8(':');
+    *classes = (struct CpuJson) {0, 0, 0, 0, 0};
+
+    for (int i = 0; i < 64; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i folded = _mm256_or_si256(chunk, fold);
+        __m256i isSpace = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, cr)));
+        __m256i bracket = _mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close));
+        __m256i separator = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma), _mm256_cmpeq_epi8(chunk, colon));
+
+        classes->quote |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote)) << i;
+        classes->backslash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, backslash)) << i;
+        classes->space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(isSpace) << i;
+        classes->bracket |= (uint64_t) (uint32_t) _mm256_movemask_epi8(bracket) << i;
+        classes->separator |= (uint64_t) (uint32_t) _mm256_movemask_epi8(separator) << i;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void Cpu_wordClassesAvx512(const char *s, struct CpuClasses *classes) {
+    const __m512i low = _mm512_broadcast_i32x4(_mm_setr_epi8(CPU_CLASS_LOW));
+    const __m512i high = _mm512_broadcast_i32x4(_mm_setr_epi8(CPU_CLASS_HIGH));
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    __m512i chunk = _mm512_loadu_si512(s);
+    __m512i bits = _mm512_and_si512(
+        _mm512_shuffle_epi8(low, _mm512_and_si512(chunk, nibble)),
+        _mm512_shuffle_epi8(high, _mm512_and_si512(_mm512_srli_epi16(chunk, 4), nibble)));
+
+    classes->word = _mm512_test_epi8_mask(bits, _mm512_set1_epi8(CPU_CLASS_WORD));
+    classes->space = _mm512_test_epi8_mask(bits, _mm512_set1_epi8(CPU_CLASS_SPACE));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void Cpu_jsonClassesAvx512(const char *s, struct CpuJson *classes) {
+    __m512i chunk = _mm512_loadu_si512(s);
+    __m512i folded = _mm512_or_si512(chunk, _mm512_set1_epi8(0x20));
+
+    classes->quote = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('"'));
+    classes->backslash = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\\'));
+    classes->space = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(' ')) |
+                     _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\t')) |
+                     _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n')) |
+                     _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\r'));
+    classes->bracket = _mm512_cmpeq_epi8_mask(folded, _mm512_set1_epi8('{')) |
+                       _mm512_cmpeq_epi8_mask(folded, _mm512_set1_epi8('}'));
+    classes->separator = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(',')) |
+                         _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(':'));
+}
+#endif
+
+/*
+    Detect the host's level and bind the kernels, capped at `maxLevel`.
+*/
+void Cpu_init(enum CpuLevel maxLevel) {
+    cpu.detected = CPU_SCALAR;
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) cpu.detected = CPU_SSE2;
+    if (__builtin_cpu_supports("avx2")) cpu.detected = CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        cpu.detected = CPU_AVX512;
+    }
+#endif
+
+    cpu.level = cpu.detected < maxLevel ? cpu.detected : maxLevel;
+
+    cpu.classify = Cpu_classifyScalar;
+    cpu.wordClasses = Cpu_wordClassesScalar;
+    cpu.jsonClasses = Cpu_jsonClassesScalar;
+#ifdef CPU_X86
+    switch (cpu.level) {
+        case CPU_AVX512:
+            cpu.classify = Cpu_classifyAvx512;
+            cpu.wordClasses = Cpu_wordClassesAvx512;
+            cpu.jsonClasses = Cpu_jsonClassesAvx512;
+            break;
+        case CPU_AVX2:
+            cpu.classify = Cpu_classifyAvx2;
+            cpu.wordClasses = Cpu_wordClassesAvx2;
+            cpu.jsonClasses = Cpu_jsonClassesAvx2;
+            break;
+        case CPU_SSE2:
+            cpu.classify = Cpu_classifySse2;
+            cpu.wordClasses = Cpu_wordClassesSse2;
+            cpu.jsonClasses = Cpu_jsonClassesSse2;
+            break;
+        default: break;
+    }
+#endif
+}
+
+int Cpu_parseLevel(const char *name) {
+    for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+        if (strcmp(name, cpuLevelNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void Cpu_printFeatures(void) {
+    printf("detected: %s\n", cpuLevelNames[cpu.detected]);
+    printf("using:    %s\n", cpuLevelNames[cpu.level]);
+}
+
+/* Text statistics */
+
+/*
+    Counts of words, characters (UTF-8) and bytes in the rows, without
+    their line endings, which depend only on the row count and are added
+    when shown. They are counted once as the file loads, with the same
+    block masks that find the newlines, and then kept up to date by each
+    edit, looking only at what it changes.
+*/
+struct TextStats {
+    long long words;
+    long long chars;
+    long long bytes;
+
+    /* Shown in the message bar, toggled by `:count`. */
+    int shown;
+};
+
+struct TextStats textStats;
+
+/*
+    Add (`sign` 1) or remove (-1) the counts of `len` bytes at `s`, taken
+    as a row on its own.
+*/
+void Stats_count(const char *s, int len, int sign) {
+    long long words = 0, continuations = 0;
+
+    /*
+        A block at a time with `cpu.classify`, as when loading, the last one
+        padded with spaces, which are neither words nor characters. Rows are
+        mostly short, and one kernel call beats a loop over their bytes.
+    */
+    uint64_t wordBefore = 0;
+    for (int i = 0; i < len; i += 64) {
+        struct CpuMasks masks;
+        if (len - i >= 64) {
+            cpu.classify(s + i, &masks);
+        } else {
+            char block[64];
+            memset(block, ' ', sizeof(block));
+            memcpy(block, s + i, len - i);
+            cpu.classify(block, &masks);
+        }
+
+        uint64_t word = ~masks.space;
+        words += __builtin_popcountll(word & ~(word << 1 | wordBefore));
+        wordBefore = word >> 63;
+        continuations += __builtin_popcountll(masks.continuation);
+    }
+
+    textStats.words += sign * words;
+    textStats.chars += sign * (len - continuations);
+    textStats.bytes += sign * len;
+}
+
+/*
+    Add or remove the single byte `c` between `prev` and `next`. A row's
+    edges count as spaces.
+*/
+void Stats_countChar(unsigned char prev, unsigned char c, unsigned char next, int sign) {
+    int prevWord = !Cpu_isSpace(prev);
+    int word = !Cpu_isSpace(c);
+    int nextWord = !Cpu_isSpace(next);
+
+    // Word starts with `c` in between, minus the ones without.
+    int starts = (word && !prevWord) + (nextWord && !word) - (nextWord && !prevWord);
+
+    textStats.words += sign * starts;
+    textStats.chars += sign * ((c & 0xc0) != 0x80);
+    textStats.bytes += sign;
+}
+
+void Stats_reset(void) {
+    textStats.words = 0;
+    textStats.chars = 0;
+    textStats.bytes = 0;
+}
+
+/*
+    Format the counts, line endings included, for the message bar.
+*/
+int Stats_format(char *buf, size_t size) {
+    long long eols = editorConfig.numRows - (editorConfig.numRows > 0 && !editorConfig.trailingNewline);
+    int eolLen = editorConfig.crlf ? 2 : 1;
+
+    return snprintf(buf, size, "%d lines  %lld words  %lld chars  %lld bytes", editorConfig.numRows,
+                    textStats.words, textStats.chars + eols * eolLen, textStats.bytes + eols * eolLen);
+}
+
+/* Decorations */
+
+/*
+    Spans of a row drawn with their own SGR attributes: misspellings, and
+    whatever plugins mark. They are collected for one row at a time, then
+    drawn in order; a span overlapping one before it is dropped.
+*/
+struct Decoration {
+    int start;
+    int end;
+    char sgr[16];
+};
+
+struct Decorations {
+    struct Decoration *items;
+    int num;
+    int cap;
+};
+
+struct Decorations decorations;
+
+void Decorations_add(int start, int end, const char *sgr) {
+    if (start >= end) return;
+
+    if (decorations.num == decorations.cap) {
+        int cap = decorations.cap ? decorations.cap * 2 : 16;
+        struct Decoration *new = Memory_realloc(MEMORY_DECORATIONS, decorations.items,
+                                                sizeof(struct Decoration) * decorations.cap,
+                                                sizeof(struct Decoration) * cap);
+        if (!new) Terminal_die("realloc");
+
+        decorations.items = new;
+        decorations.cap = cap;
+    }
+
+    struct Decoration *d = &decorations.items[decorations.num++];
+    d->start = start;
+    d->end = end;
+    snprintf(d->sgr, sizeof(d->sgr), "%s", sgr);
+}
+
+int Decorations_compare(const void *a, const void *b) {
+    const struct Decoration *da = a;
+    const struct Decoration *db = b;
+    return (da->start > db->start) - (da->start < db->start);
+}
+
+/*
+    Append the `len` bytes of `chars` from column `colOff` with the
+    decorations collected, and start over for the next row.
+*/
+void Decorations_draw(struct AppendBuffer *ab, const char *chars, int colOff, int len) {
+    qsort(decorations.items, decorations.num, sizeof(struct Decoration), Decorations_compare);
+
+    int col = colOff, end = colOff + len;
+    for (int i = 0; i < decorations.num; i++) {
+        struct Decoration *d = &decorations.items[i];
+        int start = d->start > col ? d->start : col;
+        int stop = d->end < end ? d->end : end;
+        if (d->start < col || start >= stop) continue;
+
+        char sgr[24];
+        int sgrLen = snprintf(sgr, sizeof(sgr), "\x1b[%sm", d->sgr);
+        AppendBuffer_append(ab, chars + col, start - col);
+        AppendBuffer_append(ab, sgr, sgrLen);
+        AppendBuffer_append(ab, chars + start, stop - start);
+        AppendBuffer_append(ab, "\x1b[m", 3);
+        col = stop;
+    }
+
+    AppendBuffer_append(ab, chars + col, end - col);
+    decorations.num = 0;
+}
+
+/* Spell checking */
+
+/*
+    `:spell [path]` underlines words missing from a word list, one word per
+    line (`/usr/share/dict/words` unless given). The list is mapped rather
+    than read, and the set is an open-addressing table of offsets into the
+    mapping, 4 bytes a slot, compared without regard to case.
+
+    Only the columns on the screen are checked, as a row is drawn, and what
+    was found is cached for the row until it changes or scrolls sideways.
+    A frame costs the same with checking on however large the file, and
+    the same as with it off once the rows on screen are cached.
+*/
+#define SPELL_DEFAULT_WORDS "/usr/share/dict/words"
+#define SPELL_CACHE_ROWS 256
+/* Longer runs of letters are never words (but often encoded data). */
+#define SPELL_MAX_WORD 64
+
+struct SpellRow {
+    /* Row and columns checked, `at` -1 for none. */
+    int at;
+    int colOff;
+    int cols;
+    /* Misspellings, as pairs of start and end columns. */
+    int *bad;
+    int numBad;
+    int capBad;
+};
+
+struct Spell {
+    int enabled;
+
+    char *words;
+    size_t wordsSize;
+    /* Offsets in `words` plus one; 0 is an empty slot. */
+    uint32_t *slots;
+    uint32_t mask;
+
+    /* Checked rows, by row modulo the size. */
+    struct SpellRow cache[SPELL_CACHE_ROWS];
+};
+
+struct Spell spell;
+
+int Spell_isWordByte(unsigned char c) {
+    return Cpu_isWord(c) || c == '\'';
+}
+
+uint32_t Spell_hash(const char *s, int len) {
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) s[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int Spell_wordEnds(size_t at) {
+    return at == spell.wordsSize || spell.words[at] == '\n' || spell.words[at] == '\r';
+}
+
+/*
+    Whether the word at `offset` in the list is the `len` bytes at `s`.
+*/
+int Spell_matches(uint32_t offset, const char *s, int len) {
+    if (offset + len > spell.wordsSize) return 0;
+
+    for (int i = 0; i < len; i++) {
+        if (tolower((unsigned char) spell.words[offset + i]) != tolower((unsigned char) s[i])) return 0;
+    }
+
+    return Spell_wordEnds(offset + len);
+}
+
+int Spell_contains(const char *s, int len) {
+    for (uint32_t i = Spell_hash(s, len) & spell.mask; spell.slots[i]; i = (i + 1) & spell.mask) {
+        if (Spell_matches(spell.slots[i] - 1, s, len)) return 1;
+    }
+
+    return 0;
+}
+
+/* Forget the cached rows from `at` on. */
+void Spell_invalidate(int at) {
+    if (!spell.enabled) return;
+
+    for (int i = 0; i < SPELL_CACHE_ROWS; i++) {
+        if (spell.cache[i].at >= at) spell.cache[i].at = -1;
+    }
+}
+
+void Spell_rowChanged(int at) {
+    if (!spell.enabled) return;
+
+    struct SpellRow *row = &spell.cache[at % SPELL_CACHE_ROWS];
+    if (row->at == at) row->at = -1;
+}
+
+void Spell_unload(void) {
+    if (!spell.words) return;
+
+    munmap(spell.words, spell.wordsSize);
+    Memory_free(MEMORY_SPELL, spell.slots, sizeof(*spell.slots) * (spell.mask + 1));
+    spell.words = NULL;
+    spell.slots = NULL;
+    spell.mask = 0;
+
+    for (int i = 0; i < SPELL_CACHE_ROWS; i++) {
+        struct SpellRow *row = &spell.cache[i];
+        Memory_free(MEMORY_SPELL, row->bad, sizeof(int) * 2 * row->capBad);
+        *row = (struct SpellRow) {-1, 0, 0, NULL, 0, 0};
+    }
+}
+
+/*
+    Map the word list at `path` and build the set over it. Returns -1 with
+    `errno` set on failure.
+*/
+int Spell_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Offsets are 32 bits.
+    if (st.st_size >= UINT32_MAX) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+
+    char *words = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (words == MAP_FAILED) return -1;
+
+    Spell_unload();
+    spell.words = words;
+    spell.wordsSize = st.st_size;
+
+    size_t numWords = 1;
+    for (char *nl = words; (nl = memchr(nl, '\n', words + st.st_size - nl)); nl++) numWords++;
+
+    uint32_t cap = 64;
+    while (cap < numWords * 2) cap *= 2;
+    spell.slots = Memory_alloc(MEMORY_SPELL, sizeof(*spell.slots) * cap);
+    if (!spell.slots) Terminal_die("malloc");
+    memset(spell.slots, 0, sizeof(*spell.slots) * cap);
+    spell.mask = cap - 1;
+
+    for (size_t start = 0; start < spell.wordsSize;) {
+        size_t end = start;
+        while (!Spell_wordEnds(end)) end++;
+
+        int len = end - start;
+        if (len > 0 && len <= SPELL_MAX_WORD && !Spell_contains(words + start, len)) {
+            uint32_t i = Spell_hash(words + start, len) & spell.mask;
+            while (spell.slots[i]) i = (i + 1) & spell.mask;
+            spell.slots[i] = start + 1;
+        }
+
+        start = end + 1;
+    }
+
+    for (int i = 0; i < SPELL_CACHE_ROWS; i++) spell.cache[i].at = -1;
+    return 0;
+}
+
+void Spell_addBad(struct SpellRow *row, int start, int end) {
+    if (row->numBad == row->capBad) {
+        int cap = row->capBad ? row->capBad * 2 : 8;
+        int *new = Memory_realloc(MEMORY_SPELL, row->bad, sizeof(int) * 2 * row->capBad, sizeof(int) * 2 * cap);
+        if (!new) Terminal_die("realloc");
+
+        row->bad = new;
+        row->capBad = cap;
+    }
+
+    row->bad[row->numBad * 2] = start;
+    row->bad[row->numBad * 2 + 1] = end;
+    row->numBad++;
+}
+
+/*
+    Check the words of row `at` that show between `colOff` and `colOff +
+    cols`, including ones cut by the edges. Only runs of ASCII letters,
+    with apostrophes inside, are words; identifiers like `foo_bar` or
+    `utf8` are left alone.
+*/
+void Spell_checkRow(struct SpellRow *row, int at, const char *chars, int size, int colOff, int cols) {
+    row->at = at;
+    row->colOff = colOff;
+    row->cols = cols;
+    row->numBad = 0;
+
+    int end = colOff + cols < size ? colOff + cols : size;
+    int i = colOff;
+    while (i > 0 && colOff - i < SPELL_MAX_WORD && Spell_isWordByte(chars[i - 1])) i--;
+
+    while (i < end) {
+        if (!Spell_isWordByte(chars[i])) {
+            i++;
+            continue;
+        }
+
+        int start = i, letters = 1;
+        while (i < size && i - start <= SPELL_MAX_WORD && Spell_isWordByte(chars[i])) {
+            letters &= isalpha((unsigned char) chars[i]) || chars[i] == '\'';
+            i++;
+        }
+
+        int whole = (start == 0 || !Spell_isWordByte(chars[start - 1])) &&
+                    (i == size || !Spell_isWordByte(chars[i]));
+        if (!letters || !whole) {
+            while (i < end && Spell_isWordByte(chars[i])) i++;
+            continue;
+        }
+
+        int wordStart = start, wordEnd = i;
+        while (wordStart < wordEnd && chars[wordStart] == '\'') wordStart++;
+        while (wordEnd > wordStart && chars[wordEnd - 1] == '\'') wordEnd--;
+
+        if (wordEnd - wordStart > 1 && !Spell_contains(chars + wordStart, wordEnd - wordStart)) {
+            Spell_addBad(row, wordStart, wordEnd);
+        }
+    }
+}
+
+/*
+    Add the misspellings among the columns of row `at` on the screen to
+    the row's decorations.
+*/
+void Spell_decorate(int at, const char *chars, int size) {
+    int colOff = editorConfig.colOff, cols = editorConfig.screenCols;
+    struct SpellRow *row = &spell.cache[at % SPELL_CACHE_ROWS];
+
+    if (row->at != at || row->colOff != colOff || row->cols != cols) {
+        Spell_checkRow(row, at, chars, size, colOff, cols);
+    }
+
+    for (int i = 0; i < row->numBad; i++) {
+        Decorations_add(row->bad[i * 2], row->bad[i * 2 + 1], "4;31");
+    }
+}
+
+void Spell_toggle(const char *path) {
+    if (spell.enabled && !path) {
+        spell.enabled = 0;
+        Spell_unload();
+        return;
+    }
+
+    if (!path) path = SPELL_DEFAULT_WORDS;
+    if (Spell_load(path) == -1) {
+        Editor_setStatusMessage("Can't load word list %s: %s", path, strerror(errno));
+        return;
+    }
+
+    spell.enabled = 1;
+}
+
+/* Plugins */
+
+/*
+    Plugins (see `memori.h`) run in the editor's thread, so a slow hook
+    can't be interrupted, only noticed: each call is timed, and a plugin
+    over its budget for the frame is skipped until the next one. One that
+    keeps going over is disabled, so it costs a few slow frames at most.
+*/
+#define PLUGIN_FRAME_BUDGET_NS 2000000L
+#define PLUGIN_MAX_OVERRUNS 3
+#define PLUGIN_MAX_SPANS 64
+
+struct Plugin {
+    const struct MemoriPlugin *hooks;
+    char *path;
+
+    /* Time spent in hooks this frame, and in all. */
+    long frameNs;
+    long long totalNs;
+    long long calls;
+    /* Frames it went over budget. */
+    int overruns;
+    int disabled;
+};
+
+struct Plugins {
+    struct Plugin *items;
+    int num;
+    /* Enabled plugins with an `onRowRender` hook. */
+    int numRenderers;
+};
+
+struct Plugins plugins;
+
+/*
+    Load the plugin at `path`. Returns NULL, or why it couldn't be loaded.
+*/
+const char *Plugin_load(const char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) return dlerror();
+
+    const struct MemoriPlugin *(*entry)(void);
+    *(void **) &entry = dlsym(handle, "Memori_plugin");
+    const struct MemoriPlugin *hooks = entry ? entry() : NULL;
+
+    if (!hooks || hooks->version != MEMORI_PLUGIN_VERSION) {
+        dlclose(handle);
+        return entry ? "built for another version" : "no Memori_plugin";
+    }
+
+    struct Plugin *new = Memory_realloc(MEMORY_PLUGINS, plugins.items, sizeof(struct Plugin) * plugins.num,
+                                        sizeof(struct Plugin) * (plugins.num + 1));
+    if (!new) Terminal_die("realloc");
+    plugins.items = new;
+
+    char *name = Memory_strdup(MEMORY_PLUGINS, path);
+    if (!name) Terminal_die("strdup");
+
+    plugins.items[plugins.num++] = (struct Plugin) {hooks, name, 0, 0, 0, 0, 0};
+    if (hooks->onRowRender) plugins.numRenderers++;
+    return NULL;
+}
+
+const char *Plugin_name(struct Plugin *p) {
+    return p->hooks->name ? p->hooks->name : p->path;
+}
+
+/*
+    Whether `p` may run a hook now. If so, the clock starts at `start`.
+*/
+int Plugin_start(struct Plugin *p, struct timespec *start) {
+    if (p->disabled || p->frameNs >= PLUGIN_FRAME_BUDGET_NS) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, start);
+    return 1;
+}
+
+void Plugin_stop(struct Plugin *p, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ns = Progress_since(start, &now);
+    p->frameNs += ns;
+    p->totalNs += ns;
+    p->calls++;
+}
+
+/*
+    Start a frame: count the plugins that went over budget in the last one,
+    disabling those that did too often.
+*/
+void Plugin_newFrame(void) {
+    for (int i = 0; i < plugins.num; i++) {
+        struct Plugin *p = &plugins.items[i];
+
+        if (!p->disabled && p->frameNs >= PLUGIN_FRAME_BUDGET_NS && ++p->overruns >= PLUGIN_MAX_OVERRUNS) {
+            p->disabled = 1;
+            if (p->hooks->onRowRender) plugins.numRenderers--;
+            Editor_setStatusMessage("Plugin %s disabled: over its time budget %d times",
+                                    Plugin_name(p), p->overruns);
+        }
+
+        p->frameNs = 0;
+    }
+}
+
+void Plugin_open(const char *path) {
+    struct timespec start;
+
+    for (int i = 0; i < plugins.num; i++) {
+        struct Plugin *p = &plugins.items[i];
+        if (!p->hooks->onOpen || !Plugin_start(p, &start)) continue;
+
+        p->hooks->onOpen(path, editorConfig.numRows);
+        Plugin_stop(p, &start);
+    }
+}
+
+/* Add what the plugins mark in row `at` to its decorations. */
+void Plugin_decorate(int at, const char *chars, int size) {
+    struct MemoriSpan spans[PLUGIN_MAX_SPANS];
+    struct timespec start;
+
+    for (int i = 0; i < plugins.num; i++) {
+        struct Plugin *p = &plugins.items[i];
+        if (!p->hooks->onRowRender || !Plugin_start(p, &start)) continue;
+
+        int n = p->hooks->onRowRender(at, chars, size, spans, PLUGIN_MAX_SPANS);
+        Plugin_stop(p, &start);
+
+        for (int s = 0; s < n && s < PLUGIN_MAX_SPANS; s++) {
+            char sgr[16];
+            snprintf(sgr, sizeof(sgr), "%d", spans[s].sgr);
+            Decorations_add(spans[s].start < 0 ? 0 : spans[s].start,
+                            spans[s].end > size ? size : spans[s].end, sgr);
+        }
+    }
+}
+
+/* Offer `key` to the plugins, returning whether one took it. */
+int Plugin_key(int key) {
+    struct timespec start;
+
+    for (int i = 0; i < plugins.num; i++) {
+        struct Plugin *p = &plugins.items[i];
+        if (!p->hooks->onKey || !Plugin_start(p, &start)) continue;
+
+        int taken = p->hooks->onKey(key);
+        Plugin_stop(p, &start);
+        if (taken) return 1;
+    }
+
+    return 0;
+}
+
+void Plugin_save(const char *path) {
+    struct timespec start;
+
+    for (int i = 0; i < plugins.num; i++) {
+        struct Plugin *p = &plugins.items[i];
+        if (!p->hooks->onSave || !Plugin_start(p, &start)) continue;
+
+        p->hooks->onSave(path);
+        Plugin_stop(p, &start);
+    }
+}
+
+/* `:plugins`: how long each plugin's hooks take. */
+void Plugin_show(void) {
+    if (plugins.num == 0) {
+        Editor_setStatusMessage("No plugins");
+        return;
+    }
+
+    char msg[sizeof(editorConfig.statusMessage)];
+    int len = 0;
+    for (int i = 0; i < plugins.num && len < (int) sizeof(msg); i++) {
+        struct Plugin *p = &plugins.items[i];
+        len += snprintf(&msg[len], sizeof(msg) - len, "%s%s: %lld calls, %.3fms avg, %d over%s",
+                        i ? "; " : "", Plugin_name(p), p->calls,
+                        p->calls ? p->totalNs / 1e6 / p->calls : 0.0, p->overruns,
+                        p->disabled ? ", disabled" : "");
+    }
+
+    Editor_setStatusMessage("%s", msg);
+}
+
+/* I/O engine */
+
+/*
+    Batched reads from the backing file.
+
+    Drawing a screen of evicted rows used to mean one `pread` after another,
+    each waiting on the device before the next one is even issued. On Linux,
+    a batch is instead queued on an io_uring, so every read of the batch is
+    in flight at once and we wait for all of them in a single
+    `io_uring_enter`. The ring is driven through raw syscalls, so there is no
+    library to link; when the kernel doesn't have it, or a seccomp policy
+    forbids it, reads fall back to `pread`.
+*/
+#define IO_QUEUE_DEPTH 64
+
+struct IoRequest {
+    int fd;
+    char *buf;
+    size_t len;
+    off_t offset;
+
+    /* Set by the read: 0, or the `errno` it failed with. */
+    int error;
+};
+
+struct IoRing {
+    /* -1 until the first batch, -2 if io_uring is unavailable. */
+    int fd;
+
+#ifdef __linux__
+    unsigned entries;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+struct IoRing ioRing = {.fd = -1};
+
+/*
+    Read a whole request with `pread`, resuming after `done` bytes.
+
+    A file cut short under us (truncated, or replaced by a shorter one)
+    ends the read early, which fails it with `EIO`.
+*/
+void Io_pread(struct IoRequest *req, size_t done) {
+    req->error = 0;
+
+    while (done < req->len) {
+        ssize_t n = pread(req->fd, req->buf + done, req->len - done, req->offset + done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            req->error = n == 0 ? EIO : errno;
+            return;
+        }
+
+        done += n;
+    }
+}
+
+#ifdef __linux__
+int Io_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+    if (fd < 0) return -1;
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        if (cqSize > sqSize) sqSize = cqSize;
+        cqSize = sqSize;
+    }
+
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = singleMap
+        ? sq
+        : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ioRing.entries = params.sq_entries;
+    ioRing.sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ioRing.sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ioRing.sqArray = (unsigned *) (sq + params.sq_off.array);
+    ioRing.cqHead = (unsigned *) (cq + params.cq_off.head);
+    ioRing.cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ioRing.cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ioRing.sqes = sqes;
+    ioRing.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ioRing.fd = fd;
+    return 0;
+}
+
+/*
+    Queue up to `ioRing.entries` reads and wait until all of them complete.
+
+    The kernel reads the submission tail and writes the completion tail
+    concurrently with us, hence the acquire/release accesses.
+*/
+void Io_submitBatch(struct IoRequest *reqs, int n) {
+    unsigned tail = *ioRing.sqTail;
+
+    for (int i = 0; i < n; i++) {
+        unsigned index = tail & *ioRing.sqMask;
+        struct io_uring_sqe *sqe = &ioRing.sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = reqs[i].fd;
+        sqe->addr = (uintptr_t) reqs[i].buf;
+        sqe->len = reqs[i].len;
+        sqe->off = reqs[i].offset;
+        sqe->user_data = i;
+
+        ioRing.sqArray[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ioRing.sqTail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    int completed = 0;
+    int fallBack = 0;
+    while (completed < n) {
+        int ret = syscall(__NR_io_uring_enter, ioRing.fd, n - submitted, n - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // With reads in flight, the kernel may still write to their
+            // buffers, so there's no going on without them.
+            if (submitted > completed) Terminal_die("io_uring_enter");
+
+            // Otherwise, give up on the ring and read the batch with `pread`.
+            for (int i = 0; i < n; i++) {
+                Io_pread(&reqs[i], 0);
+            }
+            fallBack = 1;
+            break;
+        }
+        if (ret > 0) submitted += ret;
+
+        unsigned head = *ioRing.cqHead;
+        unsigned cqTail = __atomic_load_n(ioRing.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cqTail; head++) {
+            struct io_uring_cqe *cqe = &ioRing.cqes[head & *ioRing.cqMask];
+            struct IoRequest *req = &reqs[cqe->user_data];
+
+            // Kernels before 5.6 don't know `IORING_OP_READ`: stop using the
+            // ring and finish this request the old way.
+            if (cqe->res == -EINVAL) fallBack = 1;
+
+            // A failed or short read is completed with `pread`, which
+            // fails it for good if it fails again.
+            Io_pread(req, cqe->res < 0 ? 0 : (size_t) cqe->res);
+            completed++;
+        }
+        __atomic_store_n(ioRing.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (fallBack) {
+        close(ioRing.fd);
+        ioRing.fd = -2;
+    }
+}
+#endif
+
+/*
+    Read every request of the batch, in no particular order.
+*/
+void Io_readBatch(struct IoRequest *reqs, int n) {
+#ifdef __linux__
+    if (ioRing.fd == -1 && Io_setup() == -1) ioRing.fd = -2;
+
+    while (ioRing.fd >= 0 && n > 0) {
+        int batch = n < (int) ioRing.entries ? n : (int) ioRing.entries;
+        Io_submitBatch(reqs, batch);
+
+        reqs += batch;
+        n -= batch;
+    }
+#endif
+
+    for (int i = 0; i < n; i++) {
+        Io_pread(&reqs[i], 0);
+    }
+}
+
+/*
+    FNV-1a, used to intern rows and to checksum them. Rows are short, so a
+    simple byte-at-a-time hash is fine.
+*/
+uint64_t Hash_fnv1a(const char *s, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/* Line interning */
+
+/*
+    With `--intern`, identical rows share one copy of their chars.
+
+    Health checks, heartbeats and retries make some logs mostly repeated
+    lines, and there every copy after the first is wasted memory. Each row
+    is hashed while loading and looked up in an open-addressing table;
+    a row seen before just takes a reference to the existing chars.
+
+    Shared chars must never be changed through one of the rows pointing at
+    them: a row has to get its own copy before it is edited. When the last
+    reference goes away, the slot becomes a tombstone so probing still
+    finds the entries placed after it.
+*/
+struct InternEntry {
+    uint64_t hash;
+    char *chars;
+    int size;
+    /* References from rows. -1 marks a tombstone. */
+    int refs;
+};
+
+struct InternTable {
+    struct InternEntry *entries;
+    /* Always a power of two. */
+    int cap;
+    /* Live entries plus tombstones. */
+    int used;
+
+    /* Rows and bytes interned, against the unique ones actually stored. */
+    size_t rows, uniqueRows;
+    size_t bytes, uniqueBytes;
+};
+
+struct InternTable internTable;
+
+/*
+    Find the entry for `s`, or NULL. When `slot` is given, it is set to
+    where `s` should be inserted if it's not there.
+*/
+struct InternEntry *Intern_find(uint64_t hash, const char *s, int len, struct InternEntry **slot) {
+    struct InternEntry *tombstone = NULL;
+
+    for (int i = hash & (internTable.cap - 1);; i = (i + 1) & (internTable.cap - 1)) {
+        struct InternEntry *e = &internTable.entries[i];
+
+        if (!e->chars) {
+            if (e->refs == -1) {
+                if (!tombstone) tombstone = e;
+                continue;
+            }
+
+            if (slot) *slot = tombstone ? tombstone : e;
+            return NULL;
+        }
+
+        if (e->hash == hash && e->size == len && memcmp(e->chars, s, len) == 0) {
+            return e;
+        }
+    }
+}
+
+/*
+    Double the table (or start it), dropping the tombstones on the way.
+*/
+void Intern_grow(void) {
+    struct InternEntry *old = internTable.entries;
+    int oldCap = internTable.cap;
+
+    internTable.cap = oldCap ? oldCap * 2 : 1024;
+    internTable.entries = Memory_alloc(MEMORY_INTERN, sizeof(struct InternEntry) * internTable.cap);
+    if (!internTable.entries) Terminal_die("malloc");
+    memset(internTable.entries, 0, sizeof(struct InternEntry) * internTable.cap);
+    internTable.used = 0;
+
+    for (int i = 0; i < oldCap; i++) {
+        if (!old[i].chars) continue;
+
+        struct InternEntry *slot = NULL;
+        Intern_find(old[i].hash, old[i].chars, old[i].size, &slot);
+        *slot = old[i];
+        internTable.used++;
+    }
+
+    Memory_free(MEMORY_INTERN, old, sizeof(struct InternEntry) * oldCap);
+}
+
+/*
+    Get the shared copy of the row `s`, taking a reference to it.
+
+    When `owned` is set, `s` is a row-chars allocation the table may keep
+    as the shared copy, or free if the row was already interned.
+*/
+char *Intern_get(char *s, int len, int owned) {
+    if (internTable.used + 1 > internTable.cap / 4 * 3) Intern_grow();
+
+    uint64_t hash = Hash_fnv1a(s, len);
+    struct InternEntry *slot;
+    struct InternEntry *e = Intern_find(hash, s, len, &slot);
+
+    internTable.rows++;
+    internTable.bytes += len + 1;
+
+    if (e) {
+        if (owned) Memory_free(MEMORY_ROW_CHARS, s, len + 1);
+        e->refs++;
+        return e->chars;
+    }
+
+    char *chars = s;
+    if (!owned) {
+        chars = Memory_alloc(MEMORY_ROW_CHARS, len + 1);
+        if (!chars) Terminal_die("malloc");
+
+        memcpy(chars, s, len);
+        chars[len] = '\0';
+    }
+
+    if (slot->refs != -1) internTable.used++;
+    slot->hash = hash;
+    slot->chars = chars;
+    slot->size = len;
+    slot->refs = 1;
+
+    internTable.uniqueRows++;
+    internTable.uniqueBytes += len + 1;
+    return chars;
+}
+
+/*
+    Drop a reference to shared chars, freeing them with the last one.
+*/
+void Intern_release(char *chars, int len) {
+    struct InternEntry *e = Intern_find(Hash_fnv1a(chars, len), chars, len, NULL);
+    if (!e) return;
+
+    internTable.rows--;
+    internTable.bytes -= len + 1;
+
+    if (--e->refs > 0) return;
+
+    Memory_free(MEMORY_ROW_CHARS, e->chars, len + 1);
+    e->chars = NULL;
+    e->refs = -1;
+
+    internTable.uniqueRows--;
+    internTable.uniqueBytes -= len + 1;
+}
+
+void Intern_reset(void) {
+    Memory_free(MEMORY_INTERN, internTable.entries, sizeof(struct InternEntry) * internTable.cap);
+    memset(&internTable, 0, sizeof(internTable));
+}
+
+void Intern_report(void) {
+    if (!internTable.uniqueRows) return;
+
+    char saved[16];
+    Memory_formatSize(saved, sizeof(saved), internTable.bytes - internTable.uniqueBytes);
+
+    Editor_setStatusMessage("Interned %zu rows as %zu unique: %.1fx dedup, %s saved",
+                            internTable.rows, internTable.uniqueRows,
+                            (double) internTable.rows / internTable.uniqueRows, saved);
+}
+
+size_t Editor_memoryUsed(void) {
+    return memoryStats[MEMORY_ROWS].live + memoryStats[MEMORY_ROW_CHARS].live +
+           memoryStats[MEMORY_INTERN].live;
+}
+
+int Editor_isRowVisible(int at) {
+    return at >= editorConfig.rowOff && at < editorConfig.rowOff + editorConfig.screenRows;
+}
+
+void Editor_freeRowChars(int at) {
+    char *chars = editorConfig.row.chars[at];
+    if (!chars) return;
+
+    if (editorConfig.row.flags[at] & ROW_INTERNED) {
+        Intern_release(chars, editorConfig.row.size[at]);
+        editorConfig.row.flags[at] &= ~ROW_INTERNED;
+    } else {
+        Memory_free(MEMORY_ROW_CHARS, chars, editorConfig.row.size[at] + 1);
+    }
+
+    editorConfig.row.chars[at] = NULL;
+}
+
+/*
+    Drop the chars of a row that can be read back from the file. Dirty rows
+    and rows without an offset only exist in memory, so they stay.
+*/
+void Editor_evictRow(int at) {
+    if (editorConfig.row.flags[at] & ROW_DIRTY || editorConfig.row.offset[at] < 0) return;
+
+    Editor_freeRowChars(at);
+}
+
+/*
+    Store chars freshly read for row `at`, interning them if asked to.
+*/
+void Editor_setRowChars(int at, char *chars) {
+    if (editorConfig.intern) {
+        chars = Intern_get(chars, editorConfig.row.size[at], 1);
+        editorConfig.row.flags[at] |= ROW_INTERNED;
+    }
+
+    editorConfig.row.chars[at] = chars;
+}
+
+/*
+    Evict rows until `len` more bytes fit in the memory budget.
+
+    Rows are visited round-robin from where the last call stopped, so over
+    time every row gets its turn and each call is cheap. Rows on the screen
+    are never evicted. If those alone don't fit, the budget is overrun
+    rather than failing to draw.
+*/
+void Editor_reserveMemory(size_t len) {
+    if (!editorConfig.maxMemory) return;
+
+    for (int scanned = 0;
+         scanned < editorConfig.numRows && Editor_memoryUsed() + len > editorConfig.maxMemory;
+         scanned++) {
+        int at = editorConfig.evictHand;
+        editorConfig.evictHand = (editorConfig.evictHand + 1) % editorConfig.numRows;
+
+        if (!Editor_isRowVisible(at)) Editor_evictRow(at);
+    }
+}
+
+/*
+    Called while waiting for input. When the kernel reports memory pressure
+    on our cgroup, drop every row that is not on the screen.
+*/
+void Editor_checkMemoryPressure(void) {
+    if (editorConfig.pressureFd == -1) return;
+
+    struct pollfd pfd = {editorConfig.pressureFd, POLLPRI, 0};
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI)) return;
+
+    for (int i = 0; i < editorConfig.numRows; i++) {
+        if (!Editor_isRowVisible(i)) Editor_evictRow(i);
+    }
+}
+
+/*
+    Ask the kernel to notify us of memory pressure (PSI) through `poll`.
+
+    The trigger fires when tasks were stalled on memory for 150ms within a 2s
+    window. The cgroup file is tried first, so in a container we react to
+    the container's limit rather than to the whole host. Kernels without
+    PSI simply leave the watcher off.
+*/
+void Editor_watchMemoryPressure(void) {
+    static const char *paths[] = {"/sys/fs/cgroup/memory.pressure", "/proc/pressure/memory"};
+    static const char trigger[] = "some 150000 2000000";
+
+    for (unsigned int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        int fd = open(paths[i], O_RDWR | O_NONBLOCK);
+        if (fd == -1) continue;
+
+        if (write(fd, trigger, sizeof(trigger)) != -1) {
+            editorConfig.pressureFd = fd;
+            return;
+        }
+
+        close(fd);
+    }
+}
+
+/*
+    Ask for transparent huge pages behind a large allocation.
+
+    The row table of a big file spans hundreds of megabytes that every pass
+    over the rows walks through, and with 4K pages that is a TLB miss every
+    few hundred rows. `madvise` wants page-aligned ranges, so only the whole
+    pages inside the block are advised.
+*/
+void Editor_adviseHugePages(void *p, size_t len) {
+#ifdef MADV_HUGEPAGE
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) p + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t) p + len) & ~(pageSize - 1);
+
+    if (end > start) madvise((void *) start, end - start, MADV_HUGEPAGE);
+#else
+    (void) p;
+    (void) len;
+#endif
+}
+
+/*
+    Resize one column of the row table from `editorConfig.rowCap` to `cap`
+    elements of `size` bytes.
+*/
+void *Editor_growRowColumn(void *column, size_t size, int cap) {
+    void *new = Memory_realloc(MEMORY_ROWS, column, size * editorConfig.rowCap, size * cap);
+    if (!new) Terminal_die("realloc");
+
+    if (editorConfig.hugePages) Editor_adviseHugePages(new, size * cap);
+    return new;
+}
+
+/*
+    Copy the sizes and offsets out of the shared index into columns of our
+    own, which can be resized and freed like any other.
+*/
+void Editor_unshareIndex(void) {
+    struct Rows *row = &editorConfig.row;
+    if (!editorConfig.indexMap) return;
+
+    int *size = Memory_alloc(MEMORY_ROWS, sizeof(*row->size) * editorConfig.rowCap);
+    off_t *offset = Memory_alloc(MEMORY_ROWS, sizeof(*row->offset) * editorConfig.rowCap);
+    if (!size || !offset) Terminal_die("malloc");
+
+    memcpy(size, row->size, sizeof(*row->size) * editorConfig.rowCap);
+    memcpy(offset, row->offset, sizeof(*row->offset) * editorConfig.rowCap);
+    munmap(editorConfig.indexMap, editorConfig.indexMapSize);
+
+    editorConfig.indexMap = NULL;
+    row->size = size;
+    row->offset = offset;
+}
+
+/*
+    Make room in the row table for one more row.
+*/
+void Editor_growRows(void) {
+    struct Rows *row = &editorConfig.row;
+    if (editorConfig.numRows < editorConfig.rowCap) return;
+
+    Editor_unshareIndex();
+
+    int cap = editorConfig.rowCap ? editorConfig.rowCap * 2 : 1024;
+
+    row->size = Editor_growRowColumn(row->size, sizeof(*row->size), cap);
+    row->offset = Editor_growRowColumn(row->offset, sizeof(*row->offset), cap);
+    row->chars = Editor_growRowColumn(row->chars, sizeof(*row->chars), cap);
+    row->flags = Editor_growRowColumn(row->flags, sizeof(*row->flags), cap);
+    editorConfig.rowCap = cap;
+}
+
+void Editor_appendRow(const char *s, size_t len, off_t offset) {
+    struct Rows *row = &editorConfig.row;
+
+    Editor_growRows();
+
+    int at = editorConfig.numRows;
+    row->size[at] = len;
+    row->offset[at] = offset;
+    row->chars[at] = NULL;
+    row->flags[at] = 0;
+    editorConfig.numRows++;
+
+    // Once over budget, the rest of the file stays on disk until it's drawn.
+    if (editorConfig.maxMemory && Editor_memoryUsed() + len + 1 > editorConfig.maxMemory) {
+        return;
+    }
+
+    if (editorConfig.intern) {
+        row->chars[at] = Intern_get((char *) s, len, 0);
+        row->flags[at] |= ROW_INTERNED;
+        return;
+    }
+
+    row->chars[at] = Memory_alloc(MEMORY_ROW_CHARS, len + 1);
+    if (!row->chars[at]) Terminal_die("malloc");
+
+    memcpy(row->chars[at], s, len);
+    row->chars[at][len] = '\0';
+}
+
+/*
+    Give up on reading row `at` back from the file, and say so.
+*/
+void Editor_readFailed(int at, int error) {
+    Editor_setStatusMessage("Can't read line %d back from the file: %s", at + 1, strerror(error));
+    errno = error;
+}
+
+/*
+    Get the chars of a row, reading them back from the file if the row was
+    evicted.
+
+    Returns NULL, with `errno` set, when they can't be read back, as when
+    the file was truncated under us. The row stays evicted, so it's tried
+    again the next time.
+*/
+char *Editor_rowChars(int at) {
+    struct Rows *row = &editorConfig.row;
+    if (row->chars[at]) return row->chars[at];
+
+    Editor_reserveMemory(row->size[at] + 1);
+
+    char *chars = Memory_alloc(MEMORY_ROW_CHARS, row->size[at] + 1);
+    if (!chars) Terminal_die("malloc");
+
+    struct IoRequest req = {editorConfig.fd, chars, row->size[at], row->offset[at], 0};
+    Io_pread(&req, 0);
+    if (req.error) {
+        Memory_free(MEMORY_ROW_CHARS, chars, row->size[at] + 1);
+        Editor_readFailed(at, req.error);
+        return NULL;
+    }
+
+    chars[row->size[at]] = '\0';
+    Editor_setRowChars(at, chars);
+    return row->chars[at];
+}
+
+/*
+    Store the chars of a batch of reads for rows `loaded`, returning -1 if
+    any of them failed. Those stay evicted.
+*/
+int Editor_finishLoad(struct IoRequest *reqs, int *loaded, int n) {
+    struct Rows *row = &editorConfig.row;
+    int result = 0;
+
+    for (int i = 0; i < n; i++) {
+        int at = loaded[i];
+
+        if (reqs[i].error) {
+            Memory_free(MEMORY_ROW_CHARS, reqs[i].buf, row->size[at] + 1);
+            Editor_readFailed(at, reqs[i].error);
+            result = -1;
+            continue;
+        }
+
+        // Only now are the chars there to be interned.
+        Editor_setRowChars(at, reqs[i].buf);
+    }
+
+    return result;
+}
+
+/*
+    Read back every evicted row in `[from, to)`, a batch of reads at a time.
+    Returns -1, with `errno` set, if some of them can't be read back.
+
+    Memory for a whole batch is reserved before any of it is allocated,
+    and the rows only get their chars once read: until then they look
+    evicted, so making room can't free a buffer the kernel is reading into.
+*/
+int Editor_loadRows(int from, int to) {
+    struct IoRequest reqs[IO_QUEUE_DEPTH];
+    int loaded[IO_QUEUE_DEPTH];
+    int result = 0;
+
+    if (to > editorConfig.numRows) to = editorConfig.numRows;
+
+    struct Rows *row = &editorConfig.row;
+
+    for (int at = from; at < to;) {
+        int n = 0;
+        size_t len = 0;
+        for (; at < to && n < IO_QUEUE_DEPTH; at++) {
+            if (row->chars[at]) continue;
+
+            loaded[n++] = at;
+            len += row->size[at] + 1;
+        }
+        if (n == 0) break;
+
+        Editor_reserveMemory(len);
+
+        for (int i = 0; i < n; i++) {
+            int size = row->size[loaded[i]];
+            char *chars = Memory_alloc(MEMORY_ROW_CHARS, size + 1);
+            if (!chars) Terminal_die("malloc");
+            chars[size] = '\0';
+
+            reqs[i] = (struct IoRequest) {editorConfig.fd, chars, size, row->offset[loaded[i]], 0};
+        }
+
+        Io_readBatch(reqs, n);
+        if (Editor_finishLoad(reqs, loaded, n) == -1) result = -1;
+    }
+
+    return result;
+}
+
+void Editor_freeRows(void) {
+    for (int i = 0; i < editorConfig.numRows; i++) {
+        Editor_freeRowChars(i);
+    }
+
+    struct Rows *row = &editorConfig.row;
+    if (editorConfig.indexMap) {
+        munmap(editorConfig.indexMap, editorConfig.indexMapSize);
+        editorConfig.indexMap = NULL;
+    } else {
+        Memory_free(MEMORY_ROWS, row->size, sizeof(*row->size) * editorConfig.rowCap);
+        Memory_free(MEMORY_ROWS, row->offset, sizeof(*row->offset) * editorConfig.rowCap);
+    }
+    Memory_free(MEMORY_ROWS, row->chars, sizeof(*row->chars) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, row->flags, sizeof(*row->flags) * editorConfig.rowCap);
+    row->size = NULL;
+    row->offset = NULL;
+    row->chars = NULL;
+    row->flags = NULL;
+    Intern_reset();
+    editorConfig.numRows = 0;
+    editorConfig.rowCap = 0;
+    editorConfig.evictHand = 0;
+
+    Memory_free(MEMORY_DIRTY, editorConfig.dirtyChunks, sizeof(struct DirtyChunk) * editorConfig.capDirtyChunks);
+    editorConfig.dirtyChunks = NULL;
+    editorConfig.numDirtyChunks = 0;
+    editorConfig.capDirtyChunks = 0;
+    editorConfig.dirty = 0;
+    editorConfig.shiftedFrom = INT_MAX;
+    Stats_reset();
+    Spell_invalidate(0);
+}
+
+/* Line numbers */
+
+/*
+    The gutter shows line numbers left of the text: absolute, or relative
+    to the cursor row with its absolute number on the cursor row. A row's
+    number is its index, so drawing it only formats digits. Its width
+    follows the digit count of the last line, and is only recomputed when
+    the row count leaves the range it was computed for.
+*/
+enum GutterMode {
+    GUTTER_OFF,
+    GUTTER_ABSOLUTE,
+    GUTTER_RELATIVE
+};
+
+struct Gutter {
+    enum GutterMode mode;
+    /* Columns taken from the text: the digits and a space. */
+    int width;
+    /* Row counts `width` is right for, as [from, to). */
+    long long from;
+    long long to;
+};
+
+struct Gutter gutter;
+
+static const char digitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/*
+    Write `n` in decimal ending right before `end`, two digits at a time
+    from the table. Returns where the digits start.
+*/
+char *Gutter_formatNumber(char *end, unsigned int n) {
+    char *p = end;
+
+    while (n >= 100) {
+        const char *pair = &digitPairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+
+    if (n >= 10) {
+        *--p = digitPairs[n * 2 + 1];
+        *--p = digitPairs[n * 2];
+    } else {
+        *--p = '0' + n;
+    }
+
+    return p;
+}
+
+void Gutter_updateWidth(void) {
+    if (gutter.mode == GUTTER_OFF) return;
+    if (editorConfig.numRows >= gutter.from && editorConfig.numRows < gutter.to) return;
+
+    // At least three digits, so small files don't shift as they grow.
+    int digits = 3;
+    long long to = 1000;
+    while (editorConfig.numRows >= to) {
+        digits++;
+        to *= 10;
+    }
+
+    gutter.from = digits == 3 ? 0 : to / 10;
+    gutter.to = to;
+
+    // The gutter takes its columns from the text.
+    editorConfig.screenCols += gutter.width - (digits + 1);
+    gutter.width = digits + 1;
+}
+
+void Gutter_setMode(enum GutterMode mode) {
+    if (mode == GUTTER_OFF) {
+        editorConfig.screenCols += gutter.width;
+        gutter.width = 0;
+    }
+
+    gutter.mode = mode;
+    gutter.from = gutter.to = 0;
+    Gutter_updateWidth();
+}
+
+void Gutter_draw(struct AppendBuffer *ab, int fileRow) {
+    unsigned int n = fileRow + 1;
+    if (gutter.mode == GUTTER_RELATIVE && fileRow != editorConfig.cy) n = abs(fileRow - editorConfig.cy);
+
+    char buf[16];
+    char *end = &buf[sizeof(buf) - 1];
+    *end = ' ';
+
+    char *start = Gutter_formatNumber(end, n);
+    while (end - start < gutter.width - 1) *--start = ' ';
+
+    AppendBuffer_append(ab, start, end + 1 - start);
+}
+
+/* Overview */
+
+/*
+    The overview is a column on the right edge summarizing the whole file,
+    one cell per screen row. Each cell is a bucket of consecutive rows and
+    shows how dense they are and the worst log level among them (red for
+    errors, yellow for warnings). The rows on the screen are highlighted.
+
+    Buckets are computed a slice at a time while waiting for input, reading
+    rows that aren't in memory straight from the file, so neither drawing
+    nor the memory budget pays for it. An edit only marks its bucket for
+    recomputing; the old values stay on screen until then.
+*/
+
+void Overview_tick(void);
+#define OVERVIEW_SLICE_NS 20000000
+#define OVERVIEW_BUFFER_SIZE (1 << 20)
+
+enum OverviewLevel {
+    OVERVIEW_NONE,
+    OVERVIEW_WARN,
+    OVERVIEW_ERROR
+};
+
+struct OverviewBucket {
+    long long bytes;
+    int rows;
+    unsigned char level;
+    unsigned char dirty;
+};
+
+struct Overview {
+    int enabled;
+    struct OverviewBucket *buckets;
+    int numBuckets;
+    /* Row count the bucket bounds were computed for. */
+    int numRows;
+    /* Largest bytes per row among the buckets, the darkest shade. */
+    long long maxDensity;
+
+    /* The bucket being computed, or -1, and how far it got. */
+    int scanBucket;
+    int scanRow;
+    struct OverviewBucket scan;
+
+    /* Rows read from the file, starting at `bufOffset`. */
+    char *buf;
+    off_t bufOffset;
+    size_t bufLen;
+
+    /* Runs `Overview_tick` while buckets are dirty. */
+    struct Timer timer;
+};
+
+struct Overview overview = {.scanBucket = -1};
+
+int Overview_bucketStart(int bucket) {
+    return (long long) bucket * editorConfig.numRows / overview.numBuckets;
+}
+
+int Overview_bucketOf(int at) {
+    if (editorConfig.numRows == 0) return 0;
+    return (long long) at * overview.numBuckets / editorConfig.numRows;
+}
+
+/*
+    Forget everything, for a new file or a new number of buckets.
+*/
+void Overview_reset(int numBuckets) {
+    if (numBuckets != overview.numBuckets) {
+        Memory_free(MEMORY_OVERVIEW, overview.buckets, sizeof(struct OverviewBucket) * overview.numBuckets);
+        overview.buckets = Memory_alloc(MEMORY_OVERVIEW, sizeof(struct OverviewBucket) * numBuckets);
+        if (!overview.buckets) Terminal_die("malloc");
+        overview.numBuckets = numBuckets;
+    }
+
+    for (int i = 0; i < numBuckets; i++) {
+        overview.buckets[i] = (struct OverviewBucket) {0, 0, OVERVIEW_NONE, 1};
+    }
+
+    overview.numRows = editorConfig.numRows;
+    overview.maxDensity = 0;
+    overview.scanBucket = -1;
+    overview.bufLen = 0;
+    Timer_add(&overview.timer, 0, Overview_tick);
+}
+
+void Overview_invalidate(int bucket) {
+    overview.buckets[bucket].dirty = 1;
+    if (bucket == overview.scanBucket) overview.scanBucket = -1;
+    Timer_add(&overview.timer, 0, Overview_tick);
+}
+
+/*
+    Row `at` changed. When rows were added or removed, the bucket bounds
+    move too, but by less than a bucket until enough of them have; only
+    then is everything recomputed.
+*/
+void Overview_rowChanged(int at) {
+    if (!overview.enabled) return;
+
+    int drift = abs(editorConfig.numRows - overview.numRows);
+    if (drift > 0 && drift * overview.numBuckets >= editorConfig.numRows) {
+        for (int i = 0; i < overview.numBuckets; i++) Overview_invalidate(i);
+        overview.numRows = editorConfig.numRows;
+        return;
+    }
+
+    int bucket = Overview_bucketOf(at);
+    if (bucket >= overview.numBuckets) bucket = overview.numBuckets - 1;
+    Overview_invalidate(bucket);
+}
+
+/*
+    Whether `word` appears in the `len` bytes at `s`.
+*/
+int Overview_contains(const char *s, int len, const char *word) {
+    int wordLen = strlen(word);
+
+    for (const char *p = s; (p = memchr(p, word[0], s + len - p)); p++) {
+        if (s + len - p < wordLen) return 0;
+        if (memcmp(p, word, wordLen) == 0) return 1;
+    }
+    return 0;
+}
+
+enum OverviewLevel Overview_level(const char *s, int len) {
+    if (Overview_contains(s, len, "ERROR") || Overview_contains(s, len, "FATAL") ||
+        Overview_contains(s, len, "error")) {
+        return OVERVIEW_ERROR;
+    }
+    if (Overview_contains(s, len, "WARN") || Overview_contains(s, len, "warn")) {
+        return OVERVIEW_WARN;
+    }
+    return OVERVIEW_NONE;
+}
+
+/*
+    Chars of row `at`: the row's own if it is in memory, otherwise read
+    from the file, a buffer at a time. NULL if it can't be read.
+*/
+const char *Overview_rowChars(int at) {
+    struct Rows *row = &editorConfig.row;
+    if (row->chars[at]) return row->chars[at];
+
+    off_t offset = row->offset[at];
+    size_t size = row->size[at];
+    if (offset < overview.bufOffset || offset + size > overview.bufOffset + overview.bufLen) {
+        if (!overview.buf) {
+            overview.buf = Memory_alloc(MEMORY_OVERVIEW, OVERVIEW_BUFFER_SIZE);
+            if (!overview.buf) Terminal_die("malloc");
+        }
+
+        ssize_t n = size <= OVERVIEW_BUFFER_SIZE ?
+                    pread(editorConfig.fd, overview.buf, OVERVIEW_BUFFER_SIZE, offset) : -1;
+        overview.bufOffset = offset;
+        overview.bufLen = n > 0 ? n : 0;
+        if (size > overview.bufLen) return NULL;
+    }
+
+    return overview.buf + (offset - overview.bufOffset);
+}
+
+void Overview_commit(void) {
+    struct OverviewBucket *b = &overview.buckets[overview.scanBucket];
+    *b = overview.scan;
+    b->dirty = 0;
+    overview.scanBucket = -1;
+
+    overview.maxDensity = 0;
+    for (int i = 0; i < overview.numBuckets; i++) {
+        struct OverviewBucket *o = &overview.buckets[i];
+        if (o->rows && o->bytes / o->rows > overview.maxDensity) overview.maxDensity = o->bytes / o->rows;
+    }
+}
+
+/*
+    Compute dirty buckets for a slice of time. Returns whether any bucket
+    changed, so the caller knows to redraw.
+*/
+int Overview_step(void) {
+    if (!overview.enabled || editorConfig.numRows == 0) return 0;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int changed = 0;
+    int next = 0;
+    while (1) {
+        if (overview.scanBucket == -1) {
+            while (next < overview.numBuckets && !overview.buckets[next].dirty) next++;
+            if (next == overview.numBuckets) break;
+
+            overview.scanBucket = next;
+            overview.scanRow = Overview_bucketStart(next);
+            overview.scan = (struct OverviewBucket) {0, 0, OVERVIEW_NONE, 0};
+        }
+
+        int end = Overview_bucketStart(overview.scanBucket + 1);
+        if (end > editorConfig.numRows) end = editorConfig.numRows;
+        int stop = overview.scanRow + 4096 < end ? overview.scanRow + 4096 : end;
+
+        for (; overview.scanRow < stop; overview.scanRow++) {
+            int size = editorConfig.row.size[overview.scanRow];
+            const char *chars = Overview_rowChars(overview.scanRow);
+
+            overview.scan.bytes += size;
+            overview.scan.rows++;
+            if (chars && overview.scan.level != OVERVIEW_ERROR) {
+                enum OverviewLevel level = Overview_level(chars, size);
+                if (level > overview.scan.level) overview.scan.level = level;
+            }
+        }
+
+        if (overview.scanRow == end) {
+            Overview_commit();
+            changed = 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) > OVERVIEW_SLICE_NS) break;
+    }
+
+    return changed;
+}
+
+/*
+    Compute a slice, and come back on the next tick until all is done.
+*/
+void Overview_tick(void) {
+    if (Overview_step()) Editor_redraw();
+
+    for (int i = 0; i < overview.numBuckets; i++) {
+        if (overview.enabled && overview.buckets[i].dirty) {
+            Timer_add(&overview.timer, TIMER_TICK_MS, Overview_tick);
+            break;
+        }
+    }
+}
+
+/*
+    Append the overview cell for screen row `y`.
+*/
+void Overview_draw(struct AppendBuffer *ab, int y) {
+    static const char shades[] = " .:-=+*#";
+
+    struct OverviewBucket *b = &overview.buckets[y];
+    int shade = 0;
+    if (b->rows && overview.maxDensity) {
+        shade = 1 + (b->bytes / b->rows) * (sizeof(shades) - 3) / overview.maxDensity;
+    }
+
+    int from = Overview_bucketStart(y);
+    int to = Overview_bucketStart(y + 1);
+    int visible = from < editorConfig.rowOff + editorConfig.screenRows && to > editorConfig.rowOff;
+    if (from == to) visible = 0;
+
+    char cell[32];
+    int len = snprintf(cell, sizeof(cell), "\x1b[%dG%s%s%c\x1b[m", gutter.width + editorConfig.screenCols + 1,
+                       visible ? "\x1b[7m" : "",
+                       b->level == OVERVIEW_ERROR ? "\x1b[31m" : b->level == OVERVIEW_WARN ? "\x1b[33m" : "",
+                       shades[shade]);
+    AppendBuffer_append(ab, cell, len);
+}
+
+void Overview_toggle(void) {
+    overview.enabled = !overview.enabled;
+
+    // The overview takes the last column from the text.
+    editorConfig.screenCols += overview.enabled ? -1 : 1;
+    if (overview.enabled) Overview_reset(editorConfig.screenRows);
+}
+
+/* Shared index */
+
+/*
+    Several editors opening the same large file would each scan all of it
+    for newlines. Instead, the first one to index a file of at least
+    INDEX_MIN_SIZE bytes leaves the sizes and offsets of its rows in a
+    cache file, and the others map that file rather than scanning: the
+    pages are shared through the page cache, and the rows are read from the
+    file as they are drawn, as if they had been evicted.
+
+    A cache file is written under a temporary name and renamed into place
+    once complete, so nobody waits on a lock and a reader sees either no
+    cache or a whole one. It is keyed by the file's device and inode, and
+    only used while the file's size and modification time still match.
+*/
+#define INDEX_MIN_SIZE (16L << 20)
+#define INDEX_MAGIC 0x3178646e69726d6dULL
+#define INDEX_HEADER_SIZE 4096
+
+/* The cache file is this header, then the offsets, then the sizes. */
+struct IndexHeader {
+    uint64_t magic;
+    uint32_t offsetSize;
+    uint32_t sizeSize;
+
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+
+    int64_t numRows;
+    int32_t crlf;
+    int32_t trailingNewline;
+    int64_t words;
+    int64_t chars;
+    int64_t bytes;
+};
+
+/*
+    Build the cache file's path for `st` in `path`, creating the directory
+    if asked to. Returns -1 if there is nowhere to put it.
+*/
+int Index_path(const struct stat *st, char *path, size_t len, int create) {
+    char dir[PATH_MAX];
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (cache && cache[0]) {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home && home[0]) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return -1;
+    }
+
+    if (create) mkdir(dir, 0700);
+    if (strlen(dir) + sizeof("/memori") > sizeof(dir)) return -1;
+    strcat(dir, "/memori");
+    if (create) mkdir(dir, 0700);
+
+    int n = snprintf(path, len, "%s/%llx-%llx.index", dir,
+                     (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+    return n < (int) len ? 0 : -1;
+}
+
+void Index_fillHeader(struct IndexHeader *h, const struct stat *st) {
+    memset(h, 0, sizeof(*h));
+    h->magic = INDEX_MAGIC;
+    h->offsetSize = sizeof(off_t);
+    h->sizeSize = sizeof(int);
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtimeSec = st->st_mtim.tv_sec;
+    h->mtimeNsec = st->st_mtim.tv_nsec;
+}
+
+/*
+    Set up the rows of the file `st` from its cache file, if there is a
+    good one. Returns whether there was.
+*/
+int Index_load(const struct stat *st) {
+    char path[PATH_MAX];
+    if (Index_path(st, path, sizeof(path), 0) == -1) return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct stat cst;
+    if (fstat(fd, &cst) == -1 || cst.st_size < INDEX_HEADER_SIZE) {
+        close(fd);
+        return 0;
+    }
+
+    // Private and writable: edits to a row's size copy just that page.
+    char *map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    struct IndexHeader expected, *h = (struct IndexHeader *) map;
+    Index_fillHeader(&expected, st);
+    expected.numRows = h->numRows;
+    expected.crlf = h->crlf;
+    expected.trailingNewline = h->trailingNewline;
+    expected.words = h->words;
+    expected.chars = h->chars;
+    expected.bytes = h->bytes;
+
+    int64_t n = h->numRows;
+    if (memcmp(h, &expected, sizeof(expected)) != 0 || n <= 0 || n > INT_MAX ||
+        cst.st_size != INDEX_HEADER_SIZE + n * (int64_t) (sizeof(off_t) + sizeof(int))) {
+        munmap(map, cst.st_size);
+        return 0;
+    }
+
+    struct Rows *row = &editorConfig.row;
+    row->offset = (off_t *) (map + INDEX_HEADER_SIZE);
+    row->size = (int *) (map + INDEX_HEADER_SIZE + n * sizeof(off_t));
+    row->chars = Memory_alloc(MEMORY_ROWS, sizeof(*row->chars) * n);
+    row->flags = Memory_alloc(MEMORY_ROWS, sizeof(*row->flags) * n);
+    if (!row->chars || !row->flags) Terminal_die("malloc");
+    memset(row->chars, 0, sizeof(*row->chars) * n);
+    memset(row->flags, 0, sizeof(*row->flags) * n);
+
+    editorConfig.indexMap = map;
+    editorConfig.indexMapSize = cst.st_size;
+    editorConfig.numRows = editorConfig.rowCap = n;
+    editorConfig.crlf = h->crlf;
+    editorConfig.trailingNewline = h->trailingNewline;
+    textStats.words = h->words;
+    textStats.chars = h->chars;
+    textStats.bytes = h->bytes;
+    return 1;
+}
+
+/*
+    Publish the rows just read from the file `st` for other editors.
+*/
+void Index_store(const struct stat *st) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    if (Index_path(st, path, sizeof(path), 1) == -1) return;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) return;
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    char header[INDEX_HEADER_SIZE] = {0};
+    struct IndexHeader *h = (struct IndexHeader *) header;
+    Index_fillHeader(h, st);
+    h->numRows = editorConfig.numRows;
+    h->crlf = editorConfig.crlf;
+    h->trailingNewline = editorConfig.trailingNewline;
+    h->words = textStats.words;
+    h->chars = textStats.chars;
+    h->bytes = textStats.bytes;
+
+    fwrite(header, 1, sizeof(header), fp);
+    fwrite(editorConfig.row.offset, sizeof(off_t), editorConfig.numRows, fp);
+    fwrite(editorConfig.row.size, sizeof(int), editorConfig.numRows, fp);
+
+    int failed = ferror(fp);
+    if (fclose(fp) != 0) failed = 1;
+    if (failed || rename(tmp, path) == -1) unlink(tmp);
+}
+
+/*
+    Append the row of `len` bytes at `offset` in the mapped file, without
+    its line ending. `newline` tells whether a newline ended it.
+*/
+void Editor_appendMappedRow(const char *map, off_t offset, size_t len, int newline) {
+    const char *start = map + offset;
+
+    if (offset == 0) editorConfig.crlf = newline && len > 0 && start[len - 1] == '\r';
+    while (len > 0 && (start[len - 1] == '\r' || start[len - 1] == '\n')) len--;
+
+    textStats.bytes += len;
+    Editor_appendRow(start, len, offset);
+}
+
+/*
+    Split the open file into rows by mapping it and scanning for newlines.
+
+    This skips the copy `getline` makes through stdio's buffer. With
+    `--populate`, files up to `POPULATE_MAX_SIZE` are mapped with
+    `MAP_POPULATE` so the kernel faults the whole file in with one call
+    instead of a page fault every 4K of the scan.
+
+    Returns -1 if the file can't be mapped, so the caller can read it instead.
+*/
+int Editor_openMapped(off_t size) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (editorConfig.populate && size <= POPULATE_MAX_SIZE) flags |= MAP_POPULATE;
+#endif
+
+    char *map = mmap(NULL, size, PROT_READ, flags, editorConfig.fd, 0);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    /*
+        Classify the bytes 64 at a time with `cpu.classify`, then walk the
+        newline bits, so short lines don't each pay for a `memchr` call.
+        The same masks give the word and character counts: a word starts
+        at a non-space byte after a space, and a character at any byte but
+        a continuation byte.
+    */
+    off_t offset = 0;
+    long long words = 0, continuations = 0;
+    uint64_t wordBefore = 0;
+    for (off_t block = 0; block < size; block += 64) {
+        if ((block & 0xffff) == 0 && Progress_update(block)) break;
+
+        struct CpuMasks masks;
+        if (size - block >= 64) {
+            cpu.classify(map + block, &masks);
+        } else {
+            char tail[64];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, map + block, size - block);
+            cpu.classify(tail, &masks);
+        }
+
+        uint64_t word = ~masks.space;
+        words += __builtin_popcountll(word & ~(word << 1 | wordBefore));
+        wordBefore = word >> 63;
+        continuations += __builtin_popcountll(masks.continuation);
+
+        uint64_t mask = masks.newline;
+        while (mask) {
+            off_t newline = block + __builtin_ctzll(mask);
+            mask &= mask - 1;
+
+            Editor_appendMappedRow(map, offset, newline - offset, 1);
+            offset = newline + 1;
+        }
+    }
+
+    if (offset < size && !progress.cancelled) Editor_appendMappedRow(map, offset, size - offset, 0);
+
+    // Line endings have no words or continuation bytes.
+    textStats.words = words;
+    textStats.chars = textStats.bytes - continuations;
+
+    editorConfig.trailingNewline = map[size - 1] == '\n';
+
+    munmap(map, size);
+    return 0;
+}
+
+/*
+    Open a file in the editor.
+
+    Whatever was open before is dropped, so this is also how we jump to
+    another file of the project. Returns -1 with `errno` set if the file
+    can't be opened, leaving the buffer as it was.
+*/
+int Editor_open(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    // Keep the file open, evicted rows are read back from it.
+    int fd = dup(fileno(fp));
+    if (fd == -1) {
+        int saved = errno;
+        fclose(fp);
+        errno = saved;
+        return -1;
+    }
+
+    // The other editor has the old buffer, not this one.
+    Collab_stop();
+    Editor_freeRows();
+    free(editorConfig.filename);
+    editorConfig.filename = strdup(path);
+    editorConfig.cx = 0;
+    editorConfig.cy = 0;
+    editorConfig.rowOff = 0;
+    editorConfig.colOff = 0;
+    editorConfig.lastRowOff = 0;
+    editorConfig.scrollSpeed = 0;
+    editorConfig.readaheadFrom = editorConfig.readaheadTo = 0;
+    editorConfig.crlf = 0;
+    editorConfig.trailingNewline = 1;
+
+    if (editorConfig.fd != -1) close(editorConfig.fd);
+    editorConfig.fd = fd;
+
+    struct stat st;
+    int regular = fstat(editorConfig.fd, &st) == 0 && S_ISREG(st.st_mode);
+    Progress_begin("Opening", regular ? st.st_size : 0, 1);
+
+    int useIndex = regular && editorConfig.shareIndex && st.st_size >= INDEX_MIN_SIZE;
+    int shared = useIndex && Index_load(&st);
+    int mapped = shared || (regular && st.st_size > 0 && Editor_openMapped(st.st_size) == 0);
+
+    if (!mapped) {
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+        off_t offset = 0;
+        while (!Progress_update(offset) && (linelen = getline(&line, &linecap, fp)) != -1) {
+            off_t next = offset + linelen;
+
+            if (offset == 0) editorConfig.crlf = linelen > 1 && line[linelen - 2] == '\r';
+            editorConfig.trailingNewline = line[linelen - 1] == '\n';
+            while (linelen > 0 && (line[linelen - 1] == '\r' || line[linelen - 1] == '\n')) {
+                linelen--;
+            }
+
+            Stats_count(line, linelen, 1);
+            Editor_appendRow(line, linelen, offset);
+            offset = next;
+        }
+
+        free(line);
+    }
+
+    fclose(fp);
+
+    /*
+        A cancelled open leaves an empty buffer with no file behind it, so
+        the part that was loaded can't be saved over the whole file.
+    */
+    if (Progress_end()) {
+        Editor_freeRows();
+        close(editorConfig.fd);
+        editorConfig.fd = -1;
+        free(editorConfig.filename);
+        editorConfig.filename = NULL;
+        Editor_setStatusMessage("Opening %s cancelled", path);
+        return 0;
+    }
+
+    fstat(editorConfig.fd, &editorConfig.fileStat);
+    if (useIndex && !shared) Index_store(&st);
+
+    if (overview.enabled) Overview_reset(overview.numBuckets);
+    if (editorConfig.intern) Intern_report();
+    Plugin_open(path);
+    return 0;
+}
+
+/* Row operations */
+
+/*
+    Insert a row that only exists in memory, so it starts out dirty.
+*/
+void Editor_insertRow(int at, const char *s, size_t len) {
+    struct Rows *row = &editorConfig.row;
+    if (at < 0 || at > editorConfig.numRows) return;
+
+    Editor_growRows();
+
+    int n = editorConfig.numRows - at;
+    memmove(&row->size[at + 1], &row->size[at], sizeof(*row->size) * n);
+    memmove(&row->offset[at + 1], &row->offset[at], sizeof(*row->offset) * n);
+    memmove(&row->chars[at + 1], &row->chars[at], sizeof(*row->chars) * n);
+    memmove(&row->flags[at + 1], &row->flags[at], sizeof(*row->flags) * n);
+
+    row->size[at] = len;
+    row->offset[at] = -1;
+    row->flags[at] = ROW_DIRTY;
+    row->chars[at] = Memory_alloc(MEMORY_ROW_CHARS, len + 1);
+    if (!row->chars[at]) Terminal_die("malloc");
+
+    memcpy(row->chars[at], s, len);
+    row->chars[at][len] = '\0';
+    Stats_count(s, len, 1);
+
+    editorConfig.numRows++;
+    editorConfig.dirty++;
+    if (at < editorConfig.shiftedFrom) editorConfig.shiftedFrom = at;
+    Overview_rowChanged(at);
+    Spell_invalidate(at);
+}
+
+void Editor_deleteRow(int at) {
+    struct Rows *row = &editorConfig.row;
+    if (at < 0 || at >= editorConfig.numRows) return;
+
+    // A row that can't be read back can still go, uncounted.
+    const char *chars = Editor_rowChars(at);
+    if (chars) Stats_count(chars, row->size[at], -1);
+
+    if (row->flags[at] & ROW_DIRTY) editorConfig.dirty--;
+    Editor_freeRowChars(at);
+
+    int n = editorConfig.numRows - at - 1;
+    memmove(&row->size[at], &row->size[at + 1], sizeof(*row->size) * n);
+    memmove(&row->offset[at], &row->offset[at + 1], sizeof(*row->offset) * n);
+    memmove(&row->chars[at], &row->chars[at + 1], sizeof(*row->chars) * n);
+    memmove(&row->flags[at], &row->flags[at + 1], sizeof(*row->flags) * n);
+
+    editorConfig.numRows--;
+    if (at < editorConfig.shiftedFrom) editorConfig.shiftedFrom = at;
+    Overview_rowChanged(at);
+    Spell_invalidate(at);
+}
+
+void Editor_addDirtyChunk(off_t offset, int size, uint64_t hash) {
+    if (editorConfig.numDirtyChunks == editorConfig.capDirtyChunks) {
+        int cap = editorConfig.capDirtyChunks ? editorConfig.capDirtyChunks * 2 : 64;
+        struct DirtyChunk *new = Memory_realloc(MEMORY_DIRTY, editorConfig.dirtyChunks,
+                                                sizeof(struct DirtyChunk) * editorConfig.capDirtyChunks,
+                                                sizeof(struct DirtyChunk) * cap);
+        if (!new) Terminal_die("realloc");
+
+        editorConfig.dirtyChunks = new;
+        editorConfig.capDirtyChunks = cap;
+    }
+
+    editorConfig.dirtyChunks[editorConfig.numDirtyChunks++] = (struct DirtyChunk) {offset, size, hash};
+}
+
+/*
+    Get a row ready to be changed, returning its chars, or NULL if they
+    can't be read back.
+
+    The first time a row changes, its original bytes are checksummed for
+    the save, and an interned row gets a private copy so the other rows
+    sharing its chars don't change with it.
+*/
+char *Editor_markDirty(int at) {
+    struct Rows *row = &editorConfig.row;
+    char *chars = Editor_rowChars(at);
+    if (!chars) return NULL;
+
+    Overview_rowChanged(at);
+    Spell_rowChanged(at);
+    if (row->flags[at] & ROW_DIRTY) return chars;
+
+    if (row->offset[at] >= 0) {
+        Editor_addDirtyChunk(row->offset[at], row->size[at], Hash_fnv1a(chars, row->size[at]));
+    }
+
+    if (row->flags[at] & ROW_INTERNED) {
+        char *copy = Memory_alloc(MEMORY_ROW_CHARS, row->size[at] + 1);
+        if (!copy) Terminal_die("malloc");
+
+        memcpy(copy, chars, row->size[at] + 1);
+        Intern_release(chars, row->size[at]);
+        row->flags[at] &= ~ROW_INTERNED;
+        row->chars[at] = chars = copy;
+    }
+
+    row->flags[at] |= ROW_DIRTY;
+    editorConfig.dirty++;
+    return chars;
+}
+
+/*
+    Resize the chars of a dirty row.
+*/
+char *Editor_resizeRow(int at, int size) {
+    struct Rows *row = &editorConfig.row;
+
+    char *new = Memory_realloc(MEMORY_ROW_CHARS, row->chars[at], row->size[at] + 1, size + 1);
+    if (!new) Terminal_die("realloc");
+
+    row->chars[at] = new;
+    row->size[at] = size;
+    new[size] = '\0';
+    return new;
+}
+
+/*
+    The row operations return -1 when the row can't be read back, leaving
+    it as it was.
+*/
+int Editor_rowInsertChar(int at, int col, int c) {
+    char *chars = Editor_markDirty(at);
+    if (!chars) return -1;
+
+    int size = editorConfig.row.size[at];
+    if (col < 0 || col > size) col = size;
+
+    Stats_countChar(col > 0 ? chars[col - 1] : ' ', c, col < size ? chars[col] : ' ', 1);
+
+    chars = Editor_resizeRow(at, size + 1);
+    memmove(&chars[col + 1], &chars[col], size - col);
+    chars[col] = c;
+    return 0;
+}
+
+int Editor_rowDeleteChar(int at, int col) {
+    char *chars = Editor_markDirty(at);
+    if (!chars) return -1;
+
+    int size = editorConfig.row.size[at];
+    if (col < 0 || col >= size) return 0;
+
+    Stats_countChar(col > 0 ? chars[col - 1] : ' ', chars[col], col + 1 < size ? chars[col + 1] : ' ', -1);
+
+    memmove(&chars[col], &chars[col + 1], size - col - 1);
+    Editor_resizeRow(at, size - 1);
+    return 0;
+}
+
+int Editor_rowAppend(int at, const char *s, size_t len) {
+    char *chars = Editor_markDirty(at);
+    if (!chars) return -1;
+
+    int size = editorConfig.row.size[at];
+
+    // A word running across the seam is one word, not two.
+    Stats_count(s, len, 1);
+    if (size > 0 && len > 0 && !Cpu_isSpace(chars[size - 1]) && !Cpu_isSpace(s[0])) textStats.words--;
+
+    chars = Editor_resizeRow(at, size + len);
+    memcpy(&chars[size], s, len);
+    return 0;
+}
+
+/*
+    Replace the `len` bytes of row `at` from `col` with the `slen` bytes at
+    `s`, which must not point into the row.
+*/
+int Editor_rowReplace(int at, int col, int len, const char *s, int slen) {
+    char *chars = Editor_markDirty(at);
+    if (!chars) return -1;
+
+    int size = editorConfig.row.size[at];
+
+    // Words can join or split at both ends; recounting the row is simpler.
+    Stats_count(chars, size, -1);
+
+    if (slen > len) chars = Editor_resizeRow(at, size + slen - len);
+    memmove(&chars[col + slen], &chars[col + len], size - col - len);
+    memcpy(&chars[col], s, slen);
+    if (slen < len) chars = Editor_resizeRow(at, size + slen - len);
+
+    Stats_count(chars, editorConfig.row.size[at], 1);
+    return 0;
+}
+
+/*
+    Split row `at` at `col`, moving the rest of it to a new row after it.
+*/
+int Editor_splitRow(int at, int col) {
+    if (col == 0) {
+        Editor_insertRow(at, "", 0);
+        return 0;
+    }
+
+    char *chars = Editor_markDirty(at);
+    if (!chars) return -1;
+
+    int size = editorConfig.row.size[at];
+
+    // The new row counts the tail on its own; splitting a word makes two.
+    Stats_count(&chars[col], size - col, -1);
+    if (col < size && !Cpu_isSpace(chars[col - 1]) && !Cpu_isSpace(chars[col])) textStats.words++;
+
+    Editor_insertRow(at + 1, &chars[col], size - col);
+    Editor_resizeRow(at, col);
+    return 0;
+}
+
+/*
+    Join row `at + 1` onto the end of row `at`.
+*/
+int Editor_joinRow(int at) {
+    // Once dirty, the row can't be evicted to make room for the next one
+    // while we copy from it.
+    if (!Editor_markDirty(at)) return -1;
+
+    const char *next = Editor_rowChars(at + 1);
+    if (!next) return -1;
+
+    Editor_rowAppend(at, next, editorConfig.row.size[at + 1]);
+    Editor_deleteRow(at + 1);
+    return 0;
+}
+
+/* Editor operations */
+
+void Editor_insertChar(int c) {
+    if (editorConfig.cy == editorConfig.numRows) {
+        Editor_insertRow(editorConfig.numRows, "", 0);
+    }
+
+    if (Editor_rowInsertChar(editorConfig.cy, editorConfig.cx, c) == -1) return;
+    editorConfig.cx++;
+}
+
+void Editor_insertNewline(void) {
+    if (editorConfig.cy == editorConfig.numRows) {
+        Editor_insertRow(editorConfig.cy, "", 0);
+    } else if (Editor_splitRow(editorConfig.cy, editorConfig.cx) == -1) {
+        return;
+    }
+
+    editorConfig.cy++;
+    editorConfig.cx = 0;
+}
+
+/*
+    Delete the character before the cursor, joining the row with the
+    previous one at its start.
+*/
+void Editor_deleteChar(void) {
+    if (editorConfig.cy == editorConfig.numRows) return;
+    if (editorConfig.cx == 0 && editorConfig.cy == 0) return;
+
+    if (editorConfig.cx > 0) {
+        if (Editor_rowDeleteChar(editorConfig.cy, editorConfig.cx - 1) == -1) return;
+        editorConfig.cx--;
+    } else {
+        int cx = editorConfig.row.size[editorConfig.cy - 1];
+        if (Editor_joinRow(editorConfig.cy - 1) == -1) return;
+        editorConfig.cx = cx;
+        editorConfig.cy--;
+    }
+}
+
+/* Motions */
+
+/*
+    Word motions move over runs of one class of bytes: word characters,
+    punctuation or whitespace, which `cpu.wordClasses` tells apart 64 bytes
+    at a time, so crossing a long row costs a few mask operations per block
+    rather than a test per byte. Like vi, `w` and `b` stop at empty rows,
+    and `e` steps over them.
+*/
+enum CharClass {
+    CLASS_SPACE,
+    CLASS_PUNCT,
+    CLASS_WORD
+};
+
+int Motion_class(unsigned char c) {
+    if (Cpu_isSpace(c)) return CLASS_SPACE;
+    return Cpu_isWord(c) ? CLASS_WORD : CLASS_PUNCT;
+}
+
+uint64_t Motion_classMask(const struct CpuClasses *classes, int cls) {
+    switch (cls) {
+    case CLASS_SPACE: return classes->space;
+    case CLASS_WORD: return classes->word;
+    default: return ~(classes->word | classes->space);
+    }
+}
+
+/*
+    Classes of the 64 bytes of `s` from `start`. Bytes outside `s[lo..hi)`
+    are never read; their bits are left for the caller to mask off.
+*/
+void Motion_classifyBlock(const char *s, int lo, int hi, int start, struct CpuClasses *classes) {
+    if (start >= lo && start + 64 <= hi) {
+        cpu.wordClasses(s + start, classes);
+        return;
+    }
+
+    char block[64];
+    int from = start < lo ? lo : start;
+    int to = start + 64 > hi ? hi : start + 64;
+
+    memset(block, ' ', sizeof(block));
+    memcpy(block + (from - start), s + from, to - from);
+    cpu.wordClasses(block, classes);
+}
+
+/*
+    Index of the first byte of `s[from..to)` that is of class `cls` (or,
+    with `match` 0, that isn't), or `to` if there is none.
+*/
+int Motion_scanForward(const char *s, int from, int to, int cls, int match) {
+    for (int start = from; start < to; start += 64) {
+        struct CpuClasses classes;
+        Motion_classifyBlock(s, from, to, start, &classes);
+
+        uint64_t mask = Motion_classMask(&classes, cls);
+        if (!match) mask = ~mask;
+        if (to - start < 64) mask &= ((uint64_t) 1 << (to - start)) - 1;
+        if (mask) return start + __builtin_ctzll(mask);
+    }
+
+    return to;
+}
+
+/*
+    Index of the last byte of `s[from..to)` that is of class `cls` (or,
+    with `match` 0, that isn't), or `from - 1` if there is none.
+*/
+int Motion_scanBackward(const char *s, int from, int to, int cls, int match) {
+    for (int end = to; end > from; end -= 64) {
+        struct CpuClasses classes;
+        int start = end - 64;
+        Motion_classifyBlock(s, from, to, start, &classes);
+
+        uint64_t mask = Motion_classMask(&classes, cls);
+        if (!match) mask = ~mask;
+        if (start < from) mask &= ~(uint64_t) 0 << (from - start);
+        if (mask) return start + 63 - __builtin_clzll(mask);
+    }
+
+    return from - 1;
+}
+
+/* `w`: move to the start of the next word, or to the next empty row. */
+void Editor_wordForward(void) {
+    int at = editorConfig.cy;
+    if (at >= editorConfig.numRows) return;
+
+    const char *chars = Editor_rowChars(at);
+    if (!chars) return;
+
+    int size = editorConfig.row.size[at];
+    int col = editorConfig.cx;
+
+    if (col < size) {
+        int cls = Motion_class(chars[col]);
+        if (cls != CLASS_SPACE) col = Motion_scanForward(chars, col, size, cls, 0);
+        col = Motion_scanForward(chars, col, size, CLASS_SPACE, 0);
+    }
+
+    while (col >= size && at + 1 < editorConfig.numRows) {
+        at++;
+        size = editorConfig.row.size[at];
+        if (size == 0) {
+            col = 0;
+            break;
+        }
+
+        // A row that can't be read back stops the motion at its start.
+        chars = Editor_rowChars(at);
+        if (!chars) {
+            col = 0;
+            break;
+        }
+        col = Motion_scanForward(chars, 0, size, CLASS_SPACE, 0);
+    }
+
+    editorConfig.cy = at;
+    editorConfig.cx = col;
+}
+
+/* `e`: move to the end of the word, or of the next one if already there. */
+void Editor_wordEnd(void) {
+    int at = editorConfig.cy;
+    if (at >= editorConfig.numRows) return;
+
+    const char *chars = Editor_rowChars(at);
+    if (!chars) return;
+
+    int size = editorConfig.row.size[at];
+    int col = editorConfig.cx + 1;
+
+    for (;;) {
+        if (col < size) {
+            col = Motion_scanForward(chars, col, size, CLASS_SPACE, 0);
+            if (col < size) break;
+        }
+
+        // Empty rows are skipped by their size alone.
+        do {
+            if (++at >= editorConfig.numRows) return;
+        } while (editorConfig.row.size[at] == 0);
+
+        chars = Editor_rowChars(at);
+        if (!chars) return;
+
+        size = editorConfig.row.size[at];
+        col = 0;
+    }
+
+    editorConfig.cy = at;
+    editorConfig.cx = Motion_scanForward(chars, col, size, Motion_class(chars[col]), 0) - 1;
+}
+
+/* `b`: move to the start of the word, or of the previous one if already there. */
+void Editor_wordBackward(void) {
+    if (editorConfig.numRows == 0) return;
+
+    int at = editorConfig.cy;
+    int col = editorConfig.cx - 1;
+    if (at >= editorConfig.numRows) {
+        at = editorConfig.numRows - 1;
+        col = editorConfig.row.size[at] - 1;
+    }
+
+    const char *chars = Editor_rowChars(at);
+    if (!chars) return;
+
+    for (;;) {
+        if (col >= 0) {
+            col = Motion_scanBackward(chars, 0, col + 1, CLASS_SPACE, 0);
+            if (col >= 0) break;
+        }
+
+        if (at == 0 || editorConfig.row.size[at - 1] == 0) {
+            editorConfig.cy = at == 0 ? 0 : at - 1;
+            editorConfig.cx = 0;
+            return;
+        }
+
+        at--;
+        chars = Editor_rowChars(at);
+        if (!chars) return;
+
+        col = editorConfig.row.size[at] - 1;
+    }
+
+    editorConfig.cy = at;
+    editorConfig.cx = Motion_scanBackward(chars, 0, col + 1, Motion_class(chars[col]), 0) + 1;
+}
+
+/*
+    `}` (`dir` 1) and `{` (`dir` -1): move past the paragraph to the next
+    empty row, or to the end of the buffer. Only the row sizes are read, so
+    crossing a huge file doesn't load (or reload evicted) rows on the way.
+*/
+void Editor_paragraphMove(int dir) {
+    int numRows = editorConfig.numRows;
+    const int *size = editorConfig.row.size;
+    if (numRows == 0) return;
+
+    int at = editorConfig.cy < numRows ? editorConfig.cy : numRows - 1;
+
+    while (at >= 0 && at < numRows && size[at] == 0) at += dir;
+    while (at >= 0 && at < numRows && size[at] != 0) at += dir;
+
+    if (at < 0) {
+        editorConfig.cy = 0;
+        editorConfig.cx = 0;
+    } else if (at >= numRows) {
+        editorConfig.cy = numRows - 1;
+        editorConfig.cx = size[numRows - 1];
+    } else {
+        editorConfig.cy = at;
+        editorConfig.cx = 0;
+    }
+}
+
+/* Reflow */
+
+/*
+    `:reflow [width]` rewraps the paragraph under the cursor to `width`
+    columns, and `:reflowall [width]` every paragraph in the buffer.
+    Paragraphs are separated by blank rows; each keeps the indent of its
+    first row, and its words are refilled greedily.
+
+    The whole buffer is reflowed in two passes. The first builds the new
+    text of the paragraphs that change into one buffer, and can be
+    cancelled without having touched anything. The second builds a new row
+    table from the old rows and the new text in one go, instead of
+    inserting and deleting rows one at a time, which would move the rest
+    of the table for every row.
+*/
+#define REFLOW_DEFAULT_WIDTH 72
+
+/* The new text, which grows by doubling: it can be as large as the file. */
+struct ReflowText {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/* Rows `[from, to)` are replaced by `numLines` lines from `start`. */
+struct ReflowChange {
+    int from;
+    int to;
+    size_t start;
+    int numLines;
+};
+
+/* A row that can't be read back is left alone, as a blank one is. */
+int Reflow_isBlank(int at) {
+    int size = editorConfig.row.size[at];
+    if (size == 0) return 1;
+
+    const char *chars = Editor_rowChars(at);
+    return !chars || Motion_scanForward(chars, 0, size, CLASS_SPACE, 0) == size;
+}
+
+/* Characters (UTF-8) in the `len` bytes at `s`. */
+int Reflow_width(const char *s, int len) {
+    int width = 0;
+    for (int i = 0; i < len; i++) width += ((unsigned char) s[i] & 0xc0) != 0x80;
+    return width;
+}
+
+void Reflow_append(struct ReflowText *text, const char *s, int len) {
+    if (text->len + len > text->cap) {
+        size_t cap = text->cap ? text->cap : 1 << 16;
+        while (cap < text->len + len) cap *= 2;
+
+        char *new = Memory_realloc(MEMORY_ROW_CHARS, text->buf, text->cap, cap);
+        if (!new) Terminal_die("realloc");
+        text->buf = new;
+        text->cap = cap;
+    }
+
+    memcpy(text->buf + text->len, s, len);
+    text->len += len;
+}
+
+/*
+    Append the lines of rows `[from, to)` refilled to `width`, each ended
+    by `\n`, and return how many there are, or -1 if a row can't be read
+    back.
+*/
+int Reflow_paragraph(struct ReflowText *text, int from, int to, int width) {
+    const char *chars = Editor_rowChars(from);
+    if (!chars) return -1;
+
+    int indentLen = Motion_scanForward(chars, 0, editorConfig.row.size[from], CLASS_SPACE, 0);
+    char *indent = Memory_alloc(MEMORY_ROW_CHARS, indentLen + 1);
+    if (!indent) Terminal_die("malloc");
+    memcpy(indent, chars, indentLen);
+    int indentWidth = Reflow_width(indent, indentLen);
+
+    int numLines = 0, lineWidth = 0, lineWords = 0;
+    for (int at = from; at < to; at++) {
+        chars = Editor_rowChars(at);
+        if (!chars) {
+            Memory_free(MEMORY_ROW_CHARS, indent, indentLen + 1);
+            return -1;
+        }
+        int size = editorConfig.row.size[at];
+
+        for (int i = Motion_scanForward(chars, 0, size, CLASS_SPACE, 0); i < size;
+             i = Motion_scanForward(chars, i, size, CLASS_SPACE, 0)) {
+            int start = i;
+            i = Motion_scanForward(chars, i, size, CLASS_SPACE, 1);
+            int wordWidth = Reflow_width(chars + start, i - start);
+
+            if (lineWords > 0 && lineWidth + 1 + wordWidth > width) {
+                Reflow_append(text, "\n", 1);
+                numLines++;
+                lineWords = 0;
+            }
+
+            if (lineWords == 0) {
+                Reflow_append(text, indent, indentLen);
+                lineWidth = indentWidth;
+            } else {
+                Reflow_append(text, " ", 1);
+                lineWidth++;
+            }
+
+            Reflow_append(text, chars + start, i - start);
+            lineWidth += wordWidth;
+            lineWords++;
+        }
+    }
+
+    if (lineWords > 0) {
+        Reflow_append(text, "\n", 1);
+        numLines++;
+    }
+
+    Memory_free(MEMORY_ROW_CHARS, indent, indentLen + 1);
+    return numLines;
+}
+
+/*
+    Whether the `numLines` lines at `s` are rows `[from, to)` as they are.
+*/
+int Reflow_unchanged(const char *s, int numLines, int from, int to) {
+    if (numLines != to - from) return 0;
+
+    for (int at = from; at < to; at++) {
+        int size = editorConfig.row.size[at];
+        const char *chars = Editor_rowChars(at);
+        if (!chars || s[size] != '\n' || memcmp(s, chars, size) != 0) return 0;
+        s += size + 1;
+    }
+
+    return 1;
+}
+
+void *Reflow_newColumn(size_t size, int cap) {
+    void *column = Memory_alloc(MEMORY_ROWS, size * cap);
+    if (!column) Terminal_die("malloc");
+
+    if (editorConfig.hugePages) Editor_adviseHugePages(column, size * cap);
+    return column;
+}
+
+/*
+    Swap in a row table with `changes` applied, `numRows` rows in all.
+*/
+void Reflow_apply(const char *text, struct ReflowChange *changes, int numChanges, int numRows) {
+    Editor_unshareIndex();
+
+    struct Rows *old = &editorConfig.row;
+    struct Rows new;
+    int cap = 1024;
+    while (cap < numRows) cap *= 2;
+
+    new.size = Reflow_newColumn(sizeof(*new.size), cap);
+    new.offset = Reflow_newColumn(sizeof(*new.offset), cap);
+    new.chars = Reflow_newColumn(sizeof(*new.chars), cap);
+    new.flags = Reflow_newColumn(sizeof(*new.flags), cap);
+
+    int cy = editorConfig.cy >= editorConfig.numRows ? numRows : -1;
+    int out = 0, prev = 0;
+    for (int c = 0; c <= numChanges; c++) {
+        int from = c < numChanges ? changes[c].from : editorConfig.numRows;
+        int n = from - prev;
+
+        memcpy(&new.size[out], &old->size[prev], sizeof(*new.size) * n);
+        memcpy(&new.offset[out], &old->offset[prev], sizeof(*new.offset) * n);
+        memcpy(&new.chars[out], &old->chars[prev], sizeof(*new.chars) * n);
+        memcpy(&new.flags[out], &old->flags[prev], sizeof(*new.flags) * n);
+        if (editorConfig.cy >= prev && editorConfig.cy < from) cy = out + editorConfig.cy - prev;
+        out += n;
+        if (c == numChanges) break;
+
+        struct ReflowChange *change = &changes[c];
+        if (editorConfig.cy >= change->from && editorConfig.cy < change->to) {
+            cy = out;
+            editorConfig.cx = 0;
+        }
+
+        for (int at = change->from; at < change->to; at++) {
+            if (old->flags[at] & ROW_DIRTY) editorConfig.dirty--;
+            Editor_freeRowChars(at);
+        }
+
+        const char *line = text + change->start;
+        for (int i = 0; i < change->numLines; i++, out++) {
+            int len = strchr(line, '\n') - line;
+
+            new.size[out] = len;
+            new.offset[out] = -1;
+            new.flags[out] = ROW_DIRTY;
+            new.chars[out] = Memory_alloc(MEMORY_ROW_CHARS, len + 1);
+            if (!new.chars[out]) Terminal_die("malloc");
+            memcpy(new.chars[out], line, len);
+            new.chars[out][len] = '\0';
+
+            editorConfig.dirty++;
+            line += len + 1;
+        }
+
+        prev = change->to;
+    }
+
+    Memory_free(MEMORY_ROWS, old->size, sizeof(*old->size) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->offset, sizeof(*old->offset) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->chars, sizeof(*old->chars) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->flags, sizeof(*old->flags) * editorConfig.rowCap);
+    *old = new;
+    editorConfig.rowCap = cap;
+    editorConfig.numRows = numRows;
+    editorConfig.evictHand = 0;
+
+    if (changes[0].from < editorConfig.shiftedFrom) editorConfig.shiftedFrom = changes[0].from;
+    editorConfig.cy = cy;
+    if (cy < numRows && editorConfig.cx > new.size[cy]) editorConfig.cx = new.size[cy];
+
+    Spell_invalidate(changes[0].from);
+    if (overview.enabled) Overview_reset(overview.numBuckets);
+}
+
+/*
+    Reflow the paragraphs in rows `[from, to)` to `width` columns.
+*/
+void Editor_reflow(int from, int to, int width) {
+    struct ReflowText text = {NULL, 0, 0};
+    struct ReflowChange *changes = NULL;
+    int numChanges = 0, capChanges = 0;
+    int numRows = editorConfig.numRows;
+    int failed = 0;
+
+    // Counted as we go, and put back if cancelled.
+    struct TextStats stats = textStats;
+
+    Progress_begin("Reflowing", to - from, 1);
+
+    int at = from;
+    while (at < to && !Progress_update(at - from)) {
+        if (Reflow_isBlank(at)) {
+            at++;
+            continue;
+        }
+
+        int start = at;
+        while (at < to && !Reflow_isBlank(at)) at++;
+
+        size_t offset = text.len;
+        int numLines = Reflow_paragraph(&text, start, at, width);
+        if (numLines == -1) {
+            failed = 1;
+            break;
+        }
+        if (Reflow_unchanged(text.buf + offset, numLines, start, at)) {
+            text.len = offset;
+            continue;
+        }
+
+        // Only whitespace changes, so the words stay the same and every
+        // byte added or removed is one character.
+        long long delta = text.len - offset - numLines;
+        for (int i = start; i < at; i++) delta -= editorConfig.row.size[i];
+        textStats.chars += delta;
+        textStats.bytes += delta;
+
+        if (numChanges == capChanges) {
+            int cap = capChanges ? capChanges * 2 : 64;
+            changes = Memory_realloc(MEMORY_ROWS, changes, sizeof(*changes) * capChanges, sizeof(*changes) * cap);
+            if (!changes) Terminal_die("realloc");
+            capChanges = cap;
+        }
+
+        changes[numChanges++] = (struct ReflowChange) {start, at, offset, numLines};
+        numRows += numLines - (at - start);
+    }
+
+    if (Progress_end()) {
+        textStats = stats;
+        Editor_setStatusMessage("Reflow cancelled");
+    } else if (failed) {
+        // The status says which row couldn't be read.
+        textStats = stats;
+    } else if (numChanges == 0) {
+        Editor_setStatusMessage("Nothing to reflow");
+    } else {
+        // Lines are found with `strchr`, so the text must end.
+        Reflow_append(&text, "", 1);
+        Reflow_apply(text.buf, changes, numChanges, numRows);
+        Editor_setStatusMessage("Reflowed %d paragraph%s", numChanges, numChanges == 1 ? "" : "s");
+    }
+
+    Memory_free(MEMORY_ROWS, changes, sizeof(*changes) * capChanges);
+    Memory_free(MEMORY_ROW_CHARS, text.buf, text.cap);
+}
+
+/*
+    Run `:reflow` (`all` 0) or `:reflowall` with `arg`, the width if any.
+*/
+void Editor_reflowCommand(const char *arg, int all) {
+    int width = *arg ? atoi(arg) : REFLOW_DEFAULT_WIDTH;
+    if (width < 1) {
+        Editor_setStatusMessage("Bad width: %s", arg);
+        return;
+    }
+
+    int from = 0, to = editorConfig.numRows;
+    if (!all) {
+        if (editorConfig.cy >= editorConfig.numRows || Reflow_isBlank(editorConfig.cy)) {
+            Editor_setStatusMessage("Not in a paragraph");
+            return;
+        }
+
+        from = to = editorConfig.cy;
+        while (from > 0 && !Reflow_isBlank(from - 1)) from--;
+        while (to < editorConfig.numRows && !Reflow_isBlank(to)) to++;
+    }
+
+    Editor_reflow(from, to, width);
+}
+
+/* JSON */
+
+/*
+    `:jsonpretty [indent]` rewrites the buffer as JSON indented by `indent`
+    spaces, a member or element a row, and `:jsonminify` as JSON without
+    whitespace outside strings, a top-level value a row (so JSON Lines stay
+    JSON Lines).
+
+    Both are one pass of a tokenizer over the rows that builds no tree: it
+    keeps only the nesting, a bit a level, and writes the new text a line
+    at a time straight into a new row table, swapped in at the end like
+    reflow's. Rows that can be read back from the file are evicted once
+    read, so apart from the new rows, the pass holds no more of the buffer
+    than the rows that were edited.
+
+    Each row is classified 64 bytes at a time, as simdjson does: with the
+    masks of `cpu.jsonClasses`, a little bit arithmetic finds the quotes
+    that aren't escaped, and a prefix XOR of those says which bytes are in
+    strings. What's left is whitespace and brackets (and for pretty-print,
+    separators) outside strings; everything between them is copied in one
+    go, strings and all.
+
+    The structure is checked (brackets match, strings end) but not the
+    grammar within it. A row ends any token, and a string can't run across
+    rows, as JSON strings can't hold a newline.
+*/
+#define JSON_DEFAULT_INDENT 2
+
+/* Finished lines at least this long are handed over rather than copied. */
+#define JSON_HANDOVER_SIZE (1 << 20)
+
+struct JsonWriter {
+    int pretty;
+    int indent;
+
+    /* The new row table. */
+    struct Rows rows;
+    int numRows;
+    int cap;
+
+    /* The line being written. */
+    char *line;
+    size_t len;
+    size_t lineCap;
+
+    /* Whether each open bracket is a `{`, a bit a level. */
+    unsigned char *stack;
+    int depth;
+    int stackCap;
+
+    /* A bracket was just opened: a value starts its first row, a close doesn't. */
+    int opened;
+
+    const char *error;
+};
+
+/* Where the tokenizer is in a row: the masks of the block it's in. */
+struct JsonScanner {
+    const char *s;
+    int size;
+    /* Offset of the block the masks are for, or -1 before the first. */
+    int block;
+    /* Outside strings: whitespace, brackets, and separators. */
+    uint64_t space;
+    uint64_t bracket;
+    uint64_t separator;
+    /* Carried into the next block: a backslash escapes its first byte; it starts in a string. */
+    uint64_t escapeCarry;
+    uint64_t inString;
+};
+
+/*
+    The bytes escaped by `backslash`es: the second of each pair in a run.
+    Runs starting on an odd bit are told from ones on an even bit by the
+    carry of adding their starts (simdjson's `find_escaped_branchless`).
+*/
+uint64_t Json_escaped(uint64_t backslash, uint64_t *carry) {
+    const uint64_t even = 0x5555555555555555ULL;
+
+    backslash &= ~*carry;
+    uint64_t followsEscape = backslash << 1 | *carry;
+    uint64_t oddStarts = backslash & ~even & ~followsEscape;
+    uint64_t evenStarts;
+    *carry = __builtin_add_overflow(oddStarts, backslash, &evenStarts);
+
+    return (even ^ (evenStarts << 1)) & followsEscape;
+}
+
+/* Bit `i` is the XOR of bits `0..i`: set from an opening quote up to its close. */
+uint64_t Json_prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+void Json_classify(struct JsonScanner *sc, int block) {
+    struct CpuJson classes;
+    if (sc->size - block >= 64) {
+        cpu.jsonClasses(sc->s + block, &classes);
+    } else {
+        // Padded with spaces, which end nothing.
+        char padded[64];
+        memset(padded, ' ', sizeof(padded));
+        memcpy(padded, sc->s + block, sc->size - block);
+        cpu.jsonClasses(padded, &classes);
+    }
+
+    uint64_t quote = classes.quote & ~Json_escaped(classes.backslash, &sc->escapeCarry);
+    uint64_t inString = Json_prefixXor(quote) ^ sc->inString;
+    sc->inString = (uint64_t) ((int64_t) inString >> 63);
+
+    sc->space = classes.space & ~inString;
+    sc->bracket = classes.bracket & ~inString;
+    sc->separator = classes.separator & ~inString;
+    sc->block = block;
+}
+
+/*
+    The first byte from `i` that isn't whitespace (`end` 0), or that ends a
+    value: whitespace, a bracket, or with `separators` a separator. Returns
+    the row size if there's none.
+*/
+int Json_next(struct JsonScanner *sc, int i, int end, int separators) {
+    while (i < sc->size) {
+        int block = i & ~63;
+        if (block != sc->block) Json_classify(sc, block);
+
+        uint64_t mask = !end ? ~sc->space : sc->space | sc->bracket | (separators ? sc->separator : 0);
+        mask &= ~0ULL << (i - block);
+        if (mask) {
+            i = block + __builtin_ctzll(mask);
+            return i < sc->size ? i : sc->size;
+        }
+        i = block + 64;
+    }
+
+    return sc->size;
+}
+
+void Json_append(struct JsonWriter *w, const char *s, size_t len) {
+    if (w->len + len > INT_MAX) {
+        w->error = "line too long";
+        return;
+    }
+
+    if (w->len + len + 1 > w->lineCap) {
+        size_t cap = w->lineCap ? w->lineCap : 256;
+        while (cap < w->len + len + 1) cap *= 2;
+
+        char *new = Memory_realloc(MEMORY_ROW_CHARS, w->line, w->lineCap, cap);
+        if (!new) Terminal_die("realloc");
+        w->line = new;
+        w->lineCap = cap;
+    }
+
+    memcpy(w->line + w->len, s, len);
+    w->len += len;
+}
+
+/* Make the line written so far a row of the new table. */
+void Json_endLine(struct JsonWriter *w) {
+    if (w->numRows == w->cap) {
+        int cap = w->cap ? w->cap * 2 : 1024;
+        struct Rows *rows = &w->rows;
+        rows->size = Memory_realloc(MEMORY_ROWS, rows->size, sizeof(*rows->size) * w->cap, sizeof(*rows->size) * cap);
+        rows->offset = Memory_realloc(MEMORY_ROWS, rows->offset, sizeof(*rows->offset) * w->cap, sizeof(*rows->offset) * cap);
+        rows->chars = Memory_realloc(MEMORY_ROWS, rows->chars, sizeof(*rows->chars) * w->cap, sizeof(*rows->chars) * cap);
+        rows->flags = Memory_realloc(MEMORY_ROWS, rows->flags, sizeof(*rows->flags) * w->cap, sizeof(*rows->flags) * cap);
+        if (!rows->size || !rows->offset || !rows->chars || !rows->flags) Terminal_die("realloc");
+        w->cap = cap;
+    }
+
+    char *chars;
+    if (w->len >= JSON_HANDOVER_SIZE) {
+        chars = Memory_realloc(MEMORY_ROW_CHARS, w->line, w->lineCap, w->len + 1);
+        if (!chars) Terminal_die("realloc");
+        w->line = NULL;
+        w->lineCap = 0;
+    } else {
+        chars = Memory_alloc(MEMORY_ROW_CHARS, w->len + 1);
+        if (!chars) Terminal_die("malloc");
+        memcpy(chars, w->line, w->len);
+    }
+    chars[w->len] = '\0';
+
+    int at = w->numRows++;
+    w->rows.size[at] = w->len;
+    w->rows.offset[at] = -1;
+    w->rows.chars[at] = chars;
+    w->rows.flags[at] = ROW_DIRTY;
+    Stats_count(chars, w->len, 1);
+    w->len = 0;
+}
+
+/* End the line and indent the next one to the current depth. */
+void Json_newline(struct JsonWriter *w) {
+    static const char spaces[64] = "                                                                ";
+    Json_endLine(w);
+
+    for (long long n = (long long) w->depth * w->indent; n > 0 && !w->error; n -= sizeof(spaces)) {
+        Json_append(w, spaces, n < (long long) sizeof(spaces) ? n : (long long) sizeof(spaces));
+    }
+}
+
+/* A value starts a row if it's the first in its brackets, or at the top. */
+void Json_beginValue(struct JsonWriter *w) {
+    if (w->opened) {
+        w->opened = 0;
+        Json_newline(w);
+    } else if (w->depth == 0 && w->len > 0) {
+        Json_endLine(w);
+    }
+}
+
+void Json_open(struct JsonWriter *w, char c) {
+    Json_beginValue(w);
+    Json_append(w, &c, 1);
+
+    if (w->depth / 8 == w->stackCap) {
+        int cap = w->stackCap ? w->stackCap * 2 : 64;
+        w->stack = Memory_realloc(MEMORY_ROWS, w->stack, w->stackCap, cap);
+        if (!w->stack) Terminal_die("realloc");
+        w->stackCap = cap;
+    }
+
+    unsigned char bit = 1 << (w->depth % 8);
+    if (c == '{') w->stack[w->depth / 8] |= bit;
+    else w->stack[w->depth / 8] &= ~bit;
+
+    w->depth++;
+    w->opened = w->pretty;
+}
+
+void Json_close(struct JsonWriter *w, char c) {
+    if (w->depth == 0 || !(w->stack[(w->depth - 1) / 8] & (1 << ((w->depth - 1) % 8))) != (c == ']')) {
+        w->error = c == '}' ? "unmatched }" : "unmatched ]";
+        return;
+    }
+
+    w->depth--;
+    if (w->opened) {
+        w->opened = 0;
+    } else if (w->pretty) {
+        Json_newline(w);
+    }
+    Json_append(w, &c, 1);
+}
+
+/*
+    Write the tokens of the row from `i`, returning where it stopped: at
+    the end, or at an error, or after about 64K bytes so the caller can
+    report progress.
+*/
+int Json_row(struct JsonWriter *w, struct JsonScanner *sc, int i) {
+    int stop = sc->size - i > 1 << 16 ? i + (1 << 16) : sc->size;
+
+    while (i < stop && !w->error) {
+        i = Json_next(sc, i, 0, 0);
+        if (i == sc->size) break;
+
+        char c = sc->s[i];
+        if ((sc->bracket | sc->separator) >> (i - sc->block) & 1) {
+            if (c == '{' || c == '[') {
+                Json_open(w, c);
+            } else if (c == '}' || c == ']') {
+                Json_close(w, c);
+                if (w->error) return i;
+            } else if (c == ',') {
+                Json_append(w, ",", 1);
+                if (w->pretty) Json_newline(w);
+            } else {
+                Json_append(w, w->pretty ? ": " : ":", w->pretty ? 2 : 1);
+            }
+            i++;
+            continue;
+        }
+
+        // Minified, a value runs on through separators to the next bracket.
+        int end = Json_next(sc, i + 1, 1, w->pretty);
+        if (end == sc->size && sc->inString) {
+            w->error = "unterminated string";
+            return i;
+        }
+
+        Json_beginValue(w);
+        Json_append(w, sc->s + i, end - i);
+        i = end;
+    }
+
+    return i;
+}
+
+void Json_freeRows(struct Rows *rows, int numRows, int cap) {
+    for (int at = 0; at < numRows; at++) {
+        Memory_free(MEMORY_ROW_CHARS, rows->chars[at], rows->size[at] + 1);
+    }
+
+    Memory_free(MEMORY_ROWS, rows->size, sizeof(*rows->size) * cap);
+    Memory_free(MEMORY_ROWS, rows->offset, sizeof(*rows->offset) * cap);
+    Memory_free(MEMORY_ROWS, rows->chars, sizeof(*rows->chars) * cap);
+    Memory_free(MEMORY_ROWS, rows->flags, sizeof(*rows->flags) * cap);
+}
+
+/*
+    Replace the buffer with its JSON pretty-printed with `indent` spaces,
+    or minified when not `pretty`.
+*/
+void Editor_json(int pretty, int indent) {
+    struct JsonWriter w;
+    memset(&w, 0, sizeof(w));
+    w.pretty = pretty;
+    w.indent = indent;
+
+    long long total = 0;
+    for (int at = 0; at < editorConfig.numRows; at++) total += editorConfig.row.size[at] + 1;
+
+    // Counted afresh as rows are written, and put back if it fails.
+    struct TextStats stats = textStats;
+    Stats_reset();
+
+    Progress_begin(pretty ? "Pretty-printing" : "Minifying", total, 1);
+
+    // Progress is checked every 64K bytes, not on each of many short rows.
+    long long done = 0, check = 0;
+    int at = 0, col = 0, unreadable = 0;
+    for (; at < editorConfig.numRows && !w.error; at++) {
+        int size = editorConfig.row.size[at];
+        const char *chars = Editor_rowChars(at);
+        if (!chars) {
+            unreadable = 1;
+            break;
+        }
+        struct JsonScanner sc = {chars, size, -1, 0, 0, 0, 0, 0};
+
+        col = 0;
+        while (col < size && !w.error) {
+            if (done + col >= check) {
+                if (Progress_update(done + col)) break;
+                check = done + col + (1 << 16);
+            }
+            col = Json_row(&w, &sc, col);
+        }
+        if (w.error || progress.cancelled) break;
+
+        done += size + 1;
+        if (editorConfig.row.offset[at] >= 0) Editor_evictRow(at);
+    }
+
+    if (!w.error && !progress.cancelled && !unreadable) {
+        if (w.depth > 0) w.error = "unclosed brackets at the end";
+        else if (w.len > 0) Json_endLine(&w);
+    }
+
+    int cancelled = Progress_end();
+    Memory_free(MEMORY_ROW_CHARS, w.line, w.lineCap);
+    Memory_free(MEMORY_ROWS, w.stack, w.stackCap);
+
+    if (cancelled || w.error || unreadable) {
+        Json_freeRows(&w.rows, w.numRows, w.cap);
+        textStats = stats;
+
+        // A row that can't be read back has said so already.
+        if (cancelled) {
+            Editor_setStatusMessage("%s cancelled", pretty ? "Pretty-printing" : "Minifying");
+        } else if (w.error && at < editorConfig.numRows) {
+            Editor_setStatusMessage("Not JSON: %s at row %d, column %d", w.error, at + 1, col + 1);
+        } else if (w.error) {
+            Editor_setStatusMessage("Not JSON: %s", w.error);
+        }
+        return;
+    }
+
+    Editor_unshareIndex();
+
+    struct Rows *old = &editorConfig.row;
+    for (int i = 0; i < editorConfig.numRows; i++) Editor_freeRowChars(i);
+    Memory_free(MEMORY_ROWS, old->size, sizeof(*old->size) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->offset, sizeof(*old->offset) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->chars, sizeof(*old->chars) * editorConfig.rowCap);
+    Memory_free(MEMORY_ROWS, old->flags, sizeof(*old->flags) * editorConfig.rowCap);
+
+    *old = w.rows;
+    editorConfig.rowCap = w.cap;
+    editorConfig.numRows = w.numRows;
+    editorConfig.evictHand = 0;
+    editorConfig.dirty = w.numRows;
+    editorConfig.shiftedFrom = 0;
+    editorConfig.cy = editorConfig.cx = 0;
+    editorConfig.rowOff = editorConfig.colOff = 0;
+
+    Spell_invalidate(0);
+    if (overview.enabled) Overview_reset(overview.numBuckets);
+    Editor_setStatusMessage("%s: %d row%s", pretty ? "Pretty-printed" : "Minified", w.numRows, w.numRows == 1 ? "" : "s");
+}
+
+/*
+    Run `:jsonpretty` with `arg`, the indent if any.
+*/
+void Editor_jsonPrettyCommand(const char *arg) {
+    int indent = *arg ? atoi(arg) : JSON_DEFAULT_INDENT;
+    if (indent < 0 || (indent == 0 && strcmp(arg, "0") != 0)) {
+        Editor_setStatusMessage("Bad indent: %s", arg);
+        return;
+    }
+
+    Editor_json(1, indent);
+}
+
+/* Collaboration */
+
+/*
+    `:share` listens on a Unix socket, and `memori --attach <socket>` opens
+    a second editor on the same buffer. The host sends its rows once, then
+    each side sends the edits it makes as operations: insert a byte at a
+    row and column, or delete the one there, where the byte can be a
+    newline. Typing, backspace, delete and `x` are made this way while
+    sharing; edits that aren't (`:reflow`) are refused.
+
+    Edits made at the same time on both sides are merged as in Jupiter
+    (Nichols et al., 1995). Each side counts the operations it has sent and
+    received, and each frame says how many of the other side's it had seen
+    when it was made. An incoming operation is transformed past the local
+    ones the other side hadn't seen, and they past it, so both sides apply
+    the same edits and end up with the same text. When both insert at the
+    same place, the host's byte goes first.
+
+    Operations made between two waits for input go out together in one
+    frame, each with its row and column as a varint delta from the one
+    before, so a typed character costs about ten bytes on the wire.
+*/
+
+#define COLLAB_OUT_SIZE 4096
+#define COLLAB_MAX_FRAME 65536
+#define COLLAB_SNAPSHOT_CHUNK 65536
+
+enum CollabOpType {
+    COLLAB_NOOP,
+    COLLAB_INSERT,
+    COLLAB_DELETE
+};
+
+/* On the wire, the type comes as one of these, with the byte after inserts. */
+enum CollabTag {
+    COLLAB_TAG_INSERT,
+    COLLAB_TAG_DELETE,
+    COLLAB_TAG_JOIN
+};
+
+/* `c` is the byte inserted, or for a delete, '\n' when it joins two rows. */
+struct CollabOp {
+    int type;
+    int row;
+    int col;
+    unsigned char c;
+};
+
+struct CollabPending {
+    struct CollabOp op;
+    /* Our count of sent operations when it was made. */
+    long long sent;
+};
+
+struct Collab {
+    /* The socket `:share` listens on and its path, or -1. */
+    int listenFd;
+    char path[108];
+    /* The other editor, or -1. */
+    int fd;
+    /* Whether we're the one sharing, whose inserts go first. */
+    int host;
+
+    long long sent;
+    long long received;
+
+    /* Operations sent that the other side hasn't seen yet. */
+    struct CollabPending *pending;
+    int numPending;
+    int capPending;
+
+    /* The frame being batched: its operations, and the count at its first. */
+    unsigned char out[COLLAB_OUT_SIZE];
+    int outLen;
+    int outOps;
+    long long outSent;
+
+    /* Bytes received but not yet a whole frame. */
+    unsigned char *in;
+    size_t inLen;
+    size_t inCap;
+
+    /* Where the last operation each way was, which the next is relative to. */
+    int outRow, outCol;
+    int inRow, inCol;
+};
+
+struct Collab collab = {.listenFd = -1, .fd = -1};
+
+struct CollabReader {
+    const unsigned char *p;
+    const unsigned char *end;
+    int bad;
+};
+
+int Collab_active(void) {
+    return collab.listenFd != -1 || collab.fd != -1;
+}
+
+int Collab_putVarint(unsigned char *p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+int Collab_varintSize(uint64_t v) {
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+uint64_t Collab_getVarint(struct CollabReader *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        unsigned char b = *r->p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+
+    r->bad = 1;
+    return 0;
+}
+
+// Deltas are signed; zigzag keeps small negative ones small.
+uint64_t Collab_zigzag(long long v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+long long Collab_unzigzag(uint64_t v) {
+    return (long long) (v >> 1) ^ -(long long) (v & 1);
+}
+
+void Collab_reset(void) {
+    collab.sent = collab.received = 0;
+    collab.numPending = 0;
+    collab.outLen = collab.outOps = 0;
+    collab.inLen = 0;
+    collab.outRow = collab.outCol = 0;
+    collab.inRow = collab.inCol = 0;
+}
+
+/*
+    Stop sharing, or leave the host's session. The buffer stays as it is,
+    now only ours.
+*/
+void Collab_stop(void) {
+    if (collab.fd != -1) {
+        close(collab.fd);
+        collab.fd = -1;
+    }
+
+    if (collab.listenFd != -1) {
+        close(collab.listenFd);
+        unlink(collab.path);
+        collab.listenFd = -1;
+    }
+}
+
+void Collab_disconnect(void) {
+    close(collab.fd);
+    collab.fd = -1;
+    Editor_setStatusMessage(collab.host ? "The other editor left" : "The host stopped sharing");
+}
+
+int Collab_send(const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(collab.fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+    Move the position `row`, `col` to where it is after `op`. `after` says
+    which side of a byte inserted right there it ends up on.
+*/
+void Collab_movePast(int *row, int *col, const struct CollabOp *op, int after) {
+    if (op->type == COLLAB_INSERT) {
+        int past = *row == op->row && (*col > op->col || (*col == op->col && after));
+        if (op->c == '\n') {
+            if (past) {
+                (*row)++;
+                *col -= op->col;
+            } else if (*row > op->row) {
+                (*row)++;
+            }
+        } else if (past) {
+            (*col)++;
+        }
+    } else if (op->type == COLLAB_DELETE) {
+        if (op->c == '\n') {
+            if (*row == op->row + 1) {
+                *row = op->row;
+                *col += op->col;
+            } else if (*row > op->row + 1) {
+                (*row)--;
+            }
+        } else if (*row == op->row && *col > op->col) {
+            (*col)--;
+        }
+    }
+}
+
+/*
+    Turn `a` and `b`, made at the same time on the same text, into `a` to
+    apply after `b` and `b` to apply after `a`. Inserts at the same place
+    put `a`'s byte first when `aFirst`.
+*/
+void Collab_transform(struct CollabOp *a, struct CollabOp *b, int aFirst) {
+    struct CollabOp a0 = *a, b0 = *b;
+
+    // Both deleted the same byte, so neither has anything left to do.
+    if (a0.type == COLLAB_DELETE && b0.type == COLLAB_DELETE && a0.row == b0.row && a0.col == b0.col) {
+        a->type = b->type = COLLAB_NOOP;
+        return;
+    }
+
+    // A deleted byte moves along with an insert before it, even at its place.
+    if (a->type != COLLAB_NOOP) Collab_movePast(&a->row, &a->col, &b0, a0.type == COLLAB_DELETE || !aFirst);
+    if (b->type != COLLAB_NOOP) Collab_movePast(&b->row, &b->col, &a0, b0.type == COLLAB_DELETE || aFirst);
+}
+
+/* Returns -1 if the row can't be read back, and the operation is lost. */
+int Collab_apply(const struct CollabOp *op) {
+    if (op->type == COLLAB_NOOP || op->row < 0 || op->row >= editorConfig.numRows) return 0;
+
+    int size = editorConfig.row.size[op->row];
+    int col = op->col < 0 ? 0 : op->col > size ? size : op->col;
+
+    if (op->type == COLLAB_INSERT && op->c == '\n') {
+        return Editor_splitRow(op->row, col);
+    } else if (op->type == COLLAB_INSERT) {
+        return Editor_rowInsertChar(op->row, col, op->c);
+    } else if (op->c == '\n') {
+        return op->row + 1 < editorConfig.numRows ? Editor_joinRow(op->row) : 0;
+    } else {
+        return Editor_rowDeleteChar(op->row, col);
+    }
+}
+
+/*
+    Send the operations batched since the last wait for input, as a frame:
+    its length, 'o', the count of sent operations at the first of them, the
+    count of received ones, how many there are, and the operations.
+*/
+void Collab_flush(void) {
+    if (collab.fd == -1 || collab.outOps == 0) return;
+
+    unsigned char header[40];
+    int n = 1;
+    header[n++] = 'o';
+    n += Collab_putVarint(header + n, collab.outSent);
+    n += Collab_putVarint(header + n, collab.received);
+    n += Collab_putVarint(header + n, collab.outOps);
+
+    // The length goes first, so the header is built after a byte of room.
+    unsigned char length[10];
+    int lengthSize = Collab_putVarint(length, n - 1 + collab.outLen);
+
+    int failed = Collab_send(length, lengthSize) == -1 ||
+                 Collab_send(header + 1, n - 1) == -1 ||
+                 Collab_send(collab.out, collab.outLen) == -1;
+    collab.outLen = collab.outOps = 0;
+    if (failed) Collab_disconnect();
+}
+
+/*
+    Make a local edit: apply it, and if someone is attached, batch it to be
+    sent and keep it until they've seen it. Returns -1 if it couldn't be
+    applied.
+*/
+int Collab_local(int type, int row, int col, int c) {
+    struct CollabOp op = {type, row, col, c};
+    if (Collab_apply(&op) == -1) return -1;
+    if (collab.fd == -1) return 0;
+
+    if (collab.numPending == collab.capPending) {
+        int cap = collab.capPending ? collab.capPending * 2 : 64;
+        collab.pending = Memory_realloc(MEMORY_COLLAB, collab.pending, sizeof(*collab.pending) * collab.capPending,
+                                        sizeof(*collab.pending) * cap);
+        if (!collab.pending) Terminal_die("realloc");
+        collab.capPending = cap;
+    }
+    collab.pending[collab.numPending++] = (struct CollabPending) {op, collab.sent};
+
+    // An operation takes at most 22 bytes.
+    if (collab.outLen > COLLAB_OUT_SIZE - 32) Collab_flush();
+    if (collab.outOps == 0) collab.outSent = collab.sent;
+
+    unsigned char *p = collab.out + collab.outLen;
+    int n = 0;
+    p[n++] = type == COLLAB_INSERT ? COLLAB_TAG_INSERT : c == '\n' ? COLLAB_TAG_JOIN : COLLAB_TAG_DELETE;
+    n += Collab_putVarint(p + n, Collab_zigzag((long long) row - collab.outRow));
+    n += Collab_putVarint(p + n, Collab_zigzag((long long) col - collab.outCol));
+    if (type == COLLAB_INSERT) p[n++] = c;
+
+    collab.outRow = row;
+    collab.outCol = col;
+    collab.outLen += n;
+    collab.outOps++;
+    collab.sent++;
+    return 0;
+}
+
+/*
+    Make the edit for an insert mode key (or `DELETE_KEY` for `x`) from the
+    cursor, returning 0 if the key doesn't edit. Operations only name rows
+    both sides have, so the row past the end is first made by a newline at
+    the end of the last one; sharing starts with at least one row.
+*/
+int Collab_editKey(int key) {
+    int cy = editorConfig.cy, cx = editorConfig.cx;
+    int numRows = editorConfig.numRows;
+
+    switch (key) {
+    case '\r':
+        if (cy == numRows) {
+            if (Collab_local(COLLAB_INSERT, cy - 1, editorConfig.row.size[cy - 1], '\n') == -1) return 1;
+        } else if (Collab_local(COLLAB_INSERT, cy, cx, '\n') == -1) {
+            return 1;
+        }
+        editorConfig.cy++;
+        editorConfig.cx = 0;
+        return 1;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+        if (cy == numRows || (cx == 0 && cy == 0)) return 1;
+        if (cx > 0) {
+            if (Collab_local(COLLAB_DELETE, cy, cx - 1, 0) == -1) return 1;
+            editorConfig.cx--;
+        } else {
+            int size = editorConfig.row.size[cy - 1];
+            if (Collab_local(COLLAB_DELETE, cy - 1, size, '\n') == -1) return 1;
+            editorConfig.cx = size;
+            editorConfig.cy--;
+        }
+        return 1;
+
+    case DELETE_KEY:
+        if (cy < numRows && cx < editorConfig.row.size[cy]) Collab_local(COLLAB_DELETE, cy, cx, 0);
+        return 1;
+    }
+
+    if (key != '\t' && (key >= 128 || !isprint(key))) return 0;
+
+    if (cy == numRows) {
+        if (Collab_local(COLLAB_INSERT, cy - 1, editorConfig.row.size[cy - 1], '\n') == -1) return 1;
+        cx = 0;
+    }
+    if (Collab_local(COLLAB_INSERT, cy, cx, key) == -1) return 1;
+    editorConfig.cx = cx + 1;
+    return 1;
+}
+
+/* Apply an operation from the other side, made after it saw `seen` of ours. */
+void Collab_receiveOp(struct CollabOp op, long long seen) {
+    int acked = 0;
+    while (acked < collab.numPending && collab.pending[acked].sent < seen) acked++;
+    collab.numPending -= acked;
+    memmove(collab.pending, collab.pending + acked, sizeof(*collab.pending) * collab.numPending);
+
+    for (int i = 0; i < collab.numPending; i++) {
+        Collab_transform(&op, &collab.pending[i].op, !collab.host);
+    }
+
+    Collab_apply(&op);
+    collab.received++;
+
+    Collab_movePast(&editorConfig.cy, &editorConfig.cx, &op, 0);
+    if (editorConfig.cy >= editorConfig.numRows) {
+        editorConfig.cy = editorConfig.numRows;
+        editorConfig.cx = 0;
+    } else if (editorConfig.cx > editorConfig.row.size[editorConfig.cy]) {
+        editorConfig.cx = editorConfig.row.size[editorConfig.cy];
+    }
+}
+
+/* Apply a frame of operations, returning 0 if it's malformed. */
+int Collab_receiveFrame(struct CollabReader *r) {
+    if (r->p == r->end || *r->p++ != 'o') return 0;
+
+    uint64_t sent = Collab_getVarint(r);
+    uint64_t seen = Collab_getVarint(r);
+    uint64_t count = Collab_getVarint(r);
+    if (r->bad || sent != (uint64_t) collab.received || seen > (uint64_t) collab.sent) return 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (r->p == r->end) return 0;
+        int tag = *r->p++;
+        collab.inRow += Collab_unzigzag(Collab_getVarint(r));
+        collab.inCol += Collab_unzigzag(Collab_getVarint(r));
+
+        struct CollabOp op = {COLLAB_DELETE, collab.inRow, collab.inCol, 0};
+        if (tag == COLLAB_TAG_INSERT) {
+            if (r->p == r->end) return 0;
+            op.type = COLLAB_INSERT;
+            op.c = *r->p++;
+        } else if (tag == COLLAB_TAG_JOIN) {
+            op.c = '\n';
+        } else if (tag != COLLAB_TAG_DELETE) {
+            return 0;
+        }
+
+        if (r->bad) return 0;
+        Collab_receiveOp(op, seen);
+    }
+
+    return r->p == r->end;
+}
+
+/* Read what the other side sent, applying each whole frame. */
+void Collab_receive(void) {
+    // Operations batched now were made before anything read here.
+    Collab_flush();
+    if (collab.fd == -1) return;
+
+    if (collab.inCap - collab.inLen < COLLAB_MAX_FRAME) {
+        size_t cap = collab.inLen + COLLAB_MAX_FRAME;
+        collab.in = Memory_realloc(MEMORY_COLLAB, collab.in, collab.inCap, cap);
+        if (!collab.in) Terminal_die("realloc");
+        collab.inCap = cap;
+    }
+
+    ssize_t n = recv(collab.fd, collab.in + collab.inLen, collab.inCap - collab.inLen, MSG_DONTWAIT);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        Collab_disconnect();
+        return;
+    }
+    if (n > 0) collab.inLen += n;
+
+    size_t pos = 0;
+    while (pos < collab.inLen) {
+        struct CollabReader r = {collab.in + pos, collab.in + collab.inLen, 0};
+        uint64_t len = Collab_getVarint(&r);
+        if (len > COLLAB_MAX_FRAME || (r.bad && collab.inLen - pos >= 10)) {
+            Collab_disconnect();
+            Editor_setStatusMessage("Bad frame from the other editor, disconnected");
+            return;
+        }
+        if (r.bad || len > (uint64_t) (r.end - r.p)) break;
+
+        r.end = r.p + len;
+        if (!Collab_receiveFrame(&r)) {
+            Collab_disconnect();
+            Editor_setStatusMessage("Bad frame from the other editor, disconnected");
+            return;
+        }
+        pos = r.end - collab.in;
+    }
+
+    memmove(collab.in, collab.in + pos, collab.inLen - pos);
+    collab.inLen -= pos;
+}
+
+/*
+    Send the whole buffer to an editor that just attached: the frame
+    length, 's', the number of rows, and each row's length and bytes.
+*/
+int Collab_sendRows(void) {
+    int numRows = editorConfig.numRows;
+    uint64_t len = 1 + Collab_varintSize(numRows);
+    for (int i = 0; i < numRows; i++) {
+        len += Collab_varintSize(editorConfig.row.size[i]) + editorConfig.row.size[i];
+    }
+
+    static unsigned char buf[COLLAB_SNAPSHOT_CHUNK];
+    int n = Collab_putVarint(buf, len);
+    buf[n++] = 's';
+    n += Collab_putVarint(buf + n, numRows);
+
+    int unreadable = 0;
+    Progress_begin("Sharing", numRows, 0);
+    for (int i = 0; i < numRows; i++) {
+        Progress_update(i);
+
+        if (n > COLLAB_SNAPSHOT_CHUNK - 10) {
+            if (Collab_send(buf, n) == -1) break;
+            n = 0;
+        }
+
+        int size = editorConfig.row.size[i];
+        n += Collab_putVarint(buf + n, size);
+
+        // The other editor is left with a snapshot cut short, and drops it.
+        const char *chars = Editor_rowChars(i);
+        if (!chars) {
+            unreadable = 1;
+            break;
+        }
+
+        while (size > 0) {
+            int chunk = size < COLLAB_SNAPSHOT_CHUNK - n ? size : COLLAB_SNAPSHOT_CHUNK - n;
+            memcpy(buf + n, chars, chunk);
+            chars += chunk;
+            size -= chunk;
+            n += chunk;
+            if (n == COLLAB_SNAPSHOT_CHUNK) {
+                if (Collab_send(buf, n) == -1) break;
+                n = 0;
+            }
+        }
+        if (size > 0) break;
+    }
+    Progress_end();
+
+    if (unreadable) return -1;
+    return Collab_send(buf, n);
+}
+
+void Collab_accept(void) {
+    int fd = accept(collab.listenFd, NULL, NULL);
+    if (fd == -1) return;
+
+    // One other editor at a time.
+    if (collab.fd != -1) {
+        close(fd);
+        return;
+    }
+
+    collab.fd = fd;
+    Collab_reset();
+    if (Collab_sendRows() == -1) {
+        Collab_disconnect();
+        return;
+    }
+
+    Editor_setStatusMessage("An editor attached");
+}
+
+/*
+    Whether the socket at `addr` is left over from an editor that died
+    while sharing: it's there, but nobody listens on it.
+*/
+int Collab_isStale(const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) return 0;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return 0;
+    int stale = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == -1 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/*
+    Toggle sharing the buffer on the socket at `path`, or by default one
+    named for this process under `$XDG_RUNTIME_DIR` or `/tmp`. The socket
+    is only for the user running the editor.
+*/
+void Collab_share(const char *path) {
+    if (Collab_active()) {
+        Collab_stop();
+        Editor_setStatusMessage("Stopped sharing");
+        return;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char defaultPath[sizeof(addr.sun_path)];
+    if (!path) {
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        if (dir && *dir) {
+            snprintf(defaultPath, sizeof(defaultPath), "%s/memori-%d.sock", dir, (int) getpid());
+        } else {
+            snprintf(defaultPath, sizeof(defaultPath), "/tmp/memori-%d-%d.sock", (int) getuid(), (int) getpid());
+        }
+        path = defaultPath;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        Editor_setStatusMessage("Socket path too long: %s", path);
+        return;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        Editor_setStatusMessage("Can't share: %s", strerror(errno));
+        return;
+    }
+
+    mode_t mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    if (bound == -1 && errno == EADDRINUSE && Collab_isStale(&addr)) {
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    umask(mask);
+    if (bound == -1 || listen(fd, 1) == -1) {
+        Editor_setStatusMessage("Can't share on %s: %s", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    static int registered = 0;
+    if (!registered) {
+        atexit(Collab_stop);
+        registered = 1;
+    }
+
+    collab.listenFd = fd;
+    collab.host = 1;
+    strcpy(collab.path, path);
+
+    if (editorConfig.numRows == 0) Editor_insertRow(0, "", 0);
+    Editor_setStatusMessage("Sharing: memori --attach %s", path);
+}
+
+/* Connect to an editor sharing at `path`, returning -1 with `errno` set. */
+int Collab_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    collab.fd = fd;
+    collab.host = 0;
+    Collab_reset();
+    return 0;
+}
+
+int Collab_recvAll(void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(collab.fd, p, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+    The rows sent on attach, received a buffer at a time so that each row
+    doesn't cost a `recv`. Never more than the snapshot is read, so the
+    operations after it stay in the socket.
+*/
+struct CollabSnapshot {
+    unsigned char buf[COLLAB_SNAPSHOT_CHUNK];
+    size_t pos;
+    size_t len;
+    /* Bytes of the snapshot not yet received. */
+    uint64_t unread;
+};
+
+/* Bytes of the snapshot not yet taken. */
+uint64_t Collab_snapshotLeft(struct CollabSnapshot *snap) {
+    return snap->unread + (snap->len - snap->pos);
+}
+
+int Collab_snapshotRead(struct CollabSnapshot *snap, void *dst, size_t n) {
+    unsigned char *p = dst;
+
+    while (n > 0) {
+        if (snap->pos == snap->len) {
+            size_t want = snap->unread < sizeof(snap->buf) ? snap->unread : sizeof(snap->buf);
+            if (want == 0) return -1;
+
+            ssize_t got = recv(collab.fd, snap->buf, want, 0);
+            if (got == -1 && errno == EINTR) continue;
+            if (got <= 0) return -1;
+
+            snap->pos = 0;
+            snap->len = got;
+            snap->unread -= got;
+        }
+
+        size_t chunk = n < snap->len - snap->pos ? n : snap->len - snap->pos;
+        memcpy(p, snap->buf + snap->pos, chunk);
+        snap->pos += chunk;
+        p += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+int Collab_snapshotVarint(struct CollabSnapshot *snap, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char b;
+        if (Collab_snapshotRead(snap, &b, 1) == -1) return -1;
+
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+
+    return -1;
+}
+
+/*
+    Replace the buffer with the rows the host sends when we attach. They
+    only exist in memory, so `--max-memory` doesn't apply to them.
+
+    Rows are taken as they arrive, and none can be longer than what's left
+    of the snapshot, so bad input can't make us allocate much more than
+    was actually sent. Returns NULL, or what was wrong, leaving the buffer
+    empty.
+*/
+const char *Collab_loadRows(void) {
+    uint64_t len = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char b;
+        if (shift >= 64 || Collab_recvAll(&b, 1) == -1) return "connection lost";
+        len |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+
+    static struct CollabSnapshot snap;
+    snap.pos = snap.len = 0;
+    snap.unread = len;
+
+    unsigned char tag;
+    uint64_t numRows;
+    if (Collab_snapshotRead(&snap, &tag, 1) == -1 || tag != 's') return "not a memori session";
+    if (Collab_snapshotVarint(&snap, &numRows) == -1) return "bad rows";
+
+    Editor_freeRows();
+    editorConfig.maxMemory = 0;
+
+    const char *error = NULL;
+    char *row = NULL;
+    size_t cap = 0;
+
+    Progress_begin("Attaching", len, 0);
+    for (uint64_t i = 0; i < numRows; i++) {
+        uint64_t size;
+        if (Collab_snapshotVarint(&snap, &size) == -1 || size > Collab_snapshotLeft(&snap) || size > INT_MAX) {
+            error = "bad rows";
+            break;
+        }
+
+        if (size + 1 > cap) {
+            char *new = Memory_realloc(MEMORY_COLLAB, row, cap, size + 1);
+            if (!new) {
+                error = "out of memory";
+                break;
+            }
+            row = new;
+            cap = size + 1;
+        }
+
+        if (Collab_snapshotRead(&snap, row, size) == -1) {
+            error = "connection lost";
+            break;
+        }
+        Progress_update(len - Collab_snapshotLeft(&snap));
+
+        Stats_count(row, size, 1);
+        Editor_appendRow(row, size, -1);
+    }
+    Progress_end();
+
+    Memory_free(MEMORY_COLLAB, row, cap);
+    if (!error && (Collab_snapshotLeft(&snap) != 0 || editorConfig.numRows == 0)) error = "bad rows";
+
+    if (error) Editor_freeRows();
+    return error;
+}
+
+/* Saving */
+
+int Editor_pwriteAll(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+    Tell whether the file changed on disk since we loaded or last saved it.
+
+    The file must still be the same inode with the same size and mtime,
+    and every chunk we are about to overwrite must still checksum to what
+    it held before we edited it. Rows we haven't changed are read back from
+    this file, so saving over someone else's changes would mix the two.
+*/
+int Editor_fileChanged(void) {
+    struct stat st, fdSt;
+    if (stat(editorConfig.filename, &st) == -1 || fstat(editorConfig.fd, &fdSt) == -1) return 1;
+
+    if (st.st_dev != fdSt.st_dev || st.st_ino != fdSt.st_ino) return 1;
+    if (st.st_size != editorConfig.fileStat.st_size) return 1;
+    if (st.st_mtim.tv_sec != editorConfig.fileStat.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != editorConfig.fileStat.st_mtim.tv_nsec) {
+        return 1;
+    }
+
+    // One buffer, big enough for the largest chunk, is read into for all.
+    int maxSize = 0;
+    for (int i = 0; i < editorConfig.numDirtyChunks; i++) {
+        if (editorConfig.dirtyChunks[i].size > maxSize) maxSize = editorConfig.dirtyChunks[i].size;
+    }
+
+    char *buf = Memory_alloc(MEMORY_DIRTY, maxSize + 1);
+    if (!buf) Terminal_die("malloc");
+
+    int changed = 0;
+    for (int i = 0; i < editorConfig.numDirtyChunks && !changed; i++) {
+        struct DirtyChunk *chunk = &editorConfig.dirtyChunks[i];
+
+        changed = pread(editorConfig.fd, buf, chunk->size, chunk->offset) != chunk->size ||
+                  Hash_fnv1a(buf, chunk->size) != chunk->hash;
+    }
+
+    Memory_free(MEMORY_DIRTY, buf, maxSize + 1);
+    return changed;
+}
+
+int Editor_compareDirtyChunks(const void *a, const void *b) {
+    const struct DirtyChunk *ca = a;
+    const struct DirtyChunk *cb = b;
+    return (ca->offset > cb->offset) - (ca->offset < cb->offset);
+}
+
+/*
+    Find the first row from which the file has to be rewritten: the first
+    row inserted or deleted, or the first dirty row whose length differs
+    from what it had on disk. Returns `INT_MAX` when every edit kept its
+    length.
+*/
+int Editor_firstShiftedRow(void) {
+    qsort(editorConfig.dirtyChunks, editorConfig.numDirtyChunks, sizeof(struct DirtyChunk),
+          Editor_compareDirtyChunks);
+
+    int end = editorConfig.shiftedFrom < editorConfig.numRows ? editorConfig.shiftedFrom : editorConfig.numRows;
+    for (int at = 0; at < end; at++) {
+        if (!(editorConfig.row.flags[at] & ROW_DIRTY)) continue;
+
+        struct DirtyChunk key = {editorConfig.row.offset[at], 0, 0};
+        struct DirtyChunk *chunk = bsearch(&key, editorConfig.dirtyChunks, editorConfig.numDirtyChunks,
+                                           sizeof(struct DirtyChunk), Editor_compareDirtyChunks);
+        if (!chunk || chunk->size != editorConfig.row.size[at]) return at;
+    }
+
+    return editorConfig.shiftedFrom;
+}
+
+/*
+    Where the line ending after row `at` ends on disk, or -1 if it can't be
+    told. Trailing `\r`s are stripped from rows on load, so the ending can
+    be longer than one byte.
+*/
+off_t Editor_rowDiskEnd(int at) {
+    off_t end = editorConfig.row.offset[at] + editorConfig.row.size[at];
+    if (end >= editorConfig.fileStat.st_size) return end;
+
+    char buf[16];
+    ssize_t n = pread(editorConfig.fd, buf, sizeof(buf), end);
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] == '\n') return end + i + 1;
+        if (buf[i] != '\r') return -1;
+    }
+
+    return -1;
+}
+
+/*
+    Write rows `[from, numRows)` to `fd` starting at `pos`, each followed by
+    a line ending but the last, which gets one only if the file had one.
+    With `leadingEol`, a line ending is written first, to end the row
+    before `from`.
+
+    Returns the position after the last byte written, or -1 on error.
+*/
+off_t Editor_writeRows(int fd, int from, off_t pos, int leadingEol) {
+    const char *eol = editorConfig.crlf ? "\r\n" : "\n";
+    int eolLen = strlen(eol);
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    if (leadingEol) AppendBuffer_append(&ab, eol, eolLen);
+
+    for (int at = from; at < editorConfig.numRows; at++) {
+        const char *chars = Editor_rowChars(at);
+        if (!chars) {
+            AppendBuffer_free(&ab);
+            return -1;
+        }
+
+        AppendBuffer_append(&ab, chars, editorConfig.row.size[at]);
+        if (at < editorConfig.numRows - 1 || editorConfig.trailingNewline) {
+            AppendBuffer_append(&ab, eol, eolLen);
+        }
+
+        if (ab.len >= (1 << 20) || at == editorConfig.numRows - 1) {
+            if (Editor_pwriteAll(fd, ab.buf, ab.len, pos) == -1) {
+                AppendBuffer_free(&ab);
+                return -1;
+            }
+
+            pos += ab.len;
+            AppendBuffer_free(&ab);
+            ab = (struct AppendBuffer) APPEND_BUFFER_INIT;
+
+            if (Progress_update(at - from)) {
+                errno = ECANCELED;
+                return -1;
+            }
+        }
+    }
+
+    if (ab.len && Editor_pwriteAll(fd, ab.buf, ab.len, pos) == -1) pos = -1;
+    else pos += ab.len;
+
+    AppendBuffer_free(&ab);
+    return pos;
+}
+
+/*
+    Now that rows `[from, numRows)` were written starting at `pos`, point
+    them at their new place in the file.
+*/
+void Editor_updateOffsets(int from, off_t pos, int leadingEol) {
+    int eolLen = editorConfig.crlf ? 2 : 1;
+    if (leadingEol) pos += eolLen;
+
+    for (int at = from; at < editorConfig.numRows; at++) {
+        editorConfig.row.offset[at] = pos;
+        pos += editorConfig.row.size[at] + eolLen;
+    }
+}
+
+/*
+    Write the dirty rows before `end` over their old bytes. They all kept
+    their length, so each one is a single `pwrite` at its offset.
+*/
+int Editor_writeInPlace(int fd, int end) {
+    for (int at = 0; at < end; at++) {
+        if (!(editorConfig.row.flags[at] & ROW_DIRTY)) continue;
+
+        if (Editor_pwriteAll(fd, editorConfig.row.chars[at], editorConfig.row.size[at],
+                             editorConfig.row.offset[at]) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Save by writing the whole buffer to a new file that then replaces the
+    old one. Unchanged rows that were evicted are read from the old file
+    while we write, which only works because it isn't the file being
+    written.
+*/
+int Editor_saveRewrite(void) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", editorConfig.filename) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int out = mkstemp(tmp);
+    if (out == -1) return -1;
+    fchmod(out, editorConfig.fileStat.st_mode & 07777);
+
+    int failed = Editor_writeRows(out, 0, 0, 0) == -1;
+    int saved = errno;
+    if (close(out) == -1 && !failed) {
+        failed = 1;
+        saved = errno;
+    }
+
+    // The new file is opened for reading before it replaces the old one,
+    // so that the rename is the last step that can fail.
+    int fd = -1;
+    if (!failed && (fd = open(tmp, O_RDONLY)) == -1) {
+        failed = 1;
+        saved = errno;
+    }
+    if (!failed && rename(tmp, editorConfig.filename) == -1) {
+        failed = 1;
+        saved = errno;
+        close(fd);
+    }
+
+    if (failed) {
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+
+    close(editorConfig.fd);
+    editorConfig.fd = fd;
+
+    Editor_updateOffsets(0, 0, 0);
+    return 0;
+}
+
+/*
+    Save the buffer, rewriting as little of the file as we can:
+
+        1. when every edit kept its length, the dirty rows are written over
+        their old bytes and nothing else is touched;
+        2. otherwise, everything before the first row that moved is left
+        alone, and the file is rewritten from there on, in place;
+        3. when rows after that point were evicted, we can't read them from
+        the file while writing over it, so the whole file is rewritten to a
+        new one instead.
+
+    Fixing a typo in a huge fixed-width file is then one small `pwrite`.
+*/
+void Editor_save(void) {
+    if (!editorConfig.filename) {
+        Editor_setStatusMessage("No file to save to");
+        return;
+    }
+
+    if (!editorConfig.dirty && editorConfig.shiftedFrom == INT_MAX) {
+        Editor_setStatusMessage("No changes to save");
+        return;
+    }
+
+    if (Editor_fileChanged()) {
+        Editor_setStatusMessage("%s changed on disk since it was opened, not saved", editorConfig.filename);
+        return;
+    }
+
+    int from = Editor_firstShiftedRow();
+    int resident = 1;
+    for (int at = from; at < editorConfig.numRows && resident; at++) {
+        resident = editorConfig.row.chars[at] != NULL;
+    }
+
+    off_t pos = 0;
+    int leadingEol = 0;
+    if (from != INT_MAX && from > 0) {
+        pos = Editor_rowDiskEnd(from - 1);
+        leadingEol = pos == editorConfig.fileStat.st_size &&
+                     editorConfig.fileStat.st_size > 0 &&
+                     !editorConfig.trailingNewline;
+        if (pos == -1) resident = 0;
+    }
+
+    // Only the rewrite to a new file can stop halfway without harm.
+    int rewrite = from != INT_MAX && !resident;
+    Progress_begin("Saving", from != INT_MAX ? editorConfig.numRows - from : 0, rewrite);
+
+    int ret;
+    if (rewrite) {
+        ret = Editor_saveRewrite();
+    } else {
+        int fd = open(editorConfig.filename, O_WRONLY);
+        ret = fd == -1 ? -1 : Editor_writeInPlace(fd, from < editorConfig.numRows ? from : editorConfig.numRows);
+
+        if (ret == 0 && from != INT_MAX) {
+            off_t end = Editor_writeRows(fd, from, pos, leadingEol);
+            ret = end == -1 || ftruncate(fd, end) == -1 ? -1 : 0;
+            if (ret == 0) Editor_updateOffsets(from, pos, leadingEol);
+        }
+
+        if (fd != -1 && close(fd) == -1) ret = -1;
+    }
+
+    Progress_end();
+    if (ret == -1 && errno == ECANCELED) {
+        Editor_setStatusMessage("Save cancelled");
+        return;
+    } else if (ret == -1) {
+        Editor_setStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    for (int at = 0; at < editorConfig.numRows; at++) {
+        editorConfig.row.flags[at] &= ~ROW_DIRTY;
+    }
+
+    editorConfig.dirty = 0;
+    editorConfig.shiftedFrom = INT_MAX;
+    editorConfig.numDirtyChunks = 0;
+    fstat(editorConfig.fd, &editorConfig.fileStat);
+    overview.bufLen = 0;
+
+    Editor_setStatusMessage("Saved %s", editorConfig.filename);
+    Plugin_save(editorConfig.filename);
+}
+
+/* Symbol index */
+
+struct Symbol {
+    char *name;
+    const char *path;
+    int line;
+};
+
+struct SymbolIndex {
+    /* Sorted by name, so a lookup is a binary search. */
+    struct Symbol *symbols;
+    int numSymbols;
+    int capSymbols;
+
+    int built;
+};
+
+struct SymbolIndex symbolIndex;
+
+int Symbol_isIdent(int c) {
+    return isalnum(c) || c == '_';
+}
+
+/*
+    Scan a line of C for a definition starting at column 0, the way most C
+    code is laid out. It recognizes:
+
+        - function definitions: `int Foo_bar(void) {`, but not prototypes;
+        - macros: `#define NAME`;
+        - tagged types: `struct NAME {`, `enum NAME {`, `union NAME {`;
+        - typedef names on the closing line: `} NAME;`.
+
+    This is a heuristic in the spirit of ctags, not a parser: it is meant to
+    be fast enough to run over a whole project on demand.
+
+    Returns the length of the name copied into `name`, or 0.
+*/
+int Symbol_scanC(const char *line, int len, char *name, int nameCap) {
+    int start = -1, end = -1;
+
+    if (len > 8 && strncmp(line, "#define ", 8) == 0) {
+        start = end = 8;
+        while (end < len && Symbol_isIdent((unsigned char) line[end])) end++;
+    } else if (line[0] == '}') {
+        start = 1;
+        while (start < len && line[start] == ' ') start++;
+        end = start;
+        while (end < len && Symbol_isIdent((unsigned char) line[end])) end++;
+        if (end >= len || line[end] != ';') return 0;
+    } else if (len > 0 && (isalpha((unsigned char) line[0]) || line[0] == '_')) {
+        const char *paren = memchr(line, '(', len);
+        const char *brace = memchr(line, '{', len);
+
+        if (paren) {
+            if (line[len - 1] == ';' || memchr(line, '=', len)) return 0;
+
+            end = paren - line;
+            while (end > 0 && line[end - 1] == ' ') end--;
+            start = end;
+            while (start > 0 && Symbol_isIdent((unsigned char) line[start - 1])) start--;
+        } else if (brace) {
+            static const char *tags[] = {"struct ", "enum ", "union "};
+
+            for (unsigned int i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+                const char *tag = strstr(line, tags[i]);
+                if (!tag || tag > brace) continue;
+
+                start = end = (tag - line) + strlen(tags[i]);
+                while (end < len && Symbol_isIdent((unsigned char) line[end])) end++;
+
+                /* `struct NAME x[] = {` uses the type, it doesn't define it. */
+                const char *next = &line[end];
+                while (*next == ' ') next++;
+                if (next != brace) return 0;
+                break;
+            }
+        }
+    }
+
+    if (start < 0 || end - start <= 0 || end - start >= nameCap) return 0;
+    if (isdigit((unsigned char) line[start])) return 0;
+
+    memcpy(name, &line[start], end - start);
+    name[end - start] = '\0';
+    return end - start;
+}
+
+/*
+    Scanners by file extension. Supporting another language is a matter of
+    writing its scanner and adding it here.
+*/
+struct SymbolScanner {
+    const char *extension;
+    int (*scan)(const char *line, int len, char *name, int nameCap);
+};
+
+static const struct SymbolScanner symbolScanners[] = {
+    {".c", Symbol_scanC},
+    {".h", Symbol_scanC},
+};
+
+void Symbol_add(const char *name, const char *path, int line) {
+    if (symbolIndex.numSymbols == symbolIndex.capSymbols) {
+        int cap = symbolIndex.capSymbols ? symbolIndex.capSymbols * 2 : 256;
+        struct Symbol *new = Memory_realloc(MEMORY_SYMBOLS, symbolIndex.symbols,
+                                            sizeof(struct Symbol) * symbolIndex.capSymbols,
+                                            sizeof(struct Symbol) * cap);
+        if (!new) Terminal_die("realloc");
+
+        symbolIndex.symbols = new;
+        symbolIndex.capSymbols = cap;
+    }
+
+    struct Symbol *sym = &symbolIndex.symbols[symbolIndex.numSymbols++];
+    sym->name = Memory_strdup(MEMORY_SYMBOLS, name);
+    if (!sym->name) Terminal_die("strdup");
+    sym->path = path;
+    sym->line = line;
+}
+
+void Symbol_scanFile(const char *path, int index) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return;
+
+    const struct SymbolScanner *scanner = NULL;
+    for (unsigned int i = 0; i < sizeof(symbolScanners) / sizeof(symbolScanners[0]); i++) {
+        if (strcmp(ext, symbolScanners[i].extension) == 0) {
+            scanner = &symbolScanners[i];
+            break;
+        }
+    }
+    if (!scanner) return;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    char name[128];
+
+    for (int at = 0; (linelen = getline(&line, &linecap, fp)) != -1; at++) {
+        if (Progress_update(index)) break;
+
+        while (linelen > 0 && (line[linelen - 1] == '\r' || line[linelen - 1] == '\n')) {
+            linelen--;
+        }
+
+        if (linelen > 0 && scanner->scan(line, linelen, name, sizeof(name))) {
+            Symbol_add(name, path, at);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+int Symbol_compare(const void *a, const void *b) {
+    const struct Symbol *sa = a;
+    const struct Symbol *sb = b;
+    return strcmp(sa->name, sb->name);
+}
+
+/*
+    Index every file the picker knows about, or just the open file when the
+    editor was started on a single file. The index is built the first time
+    it's needed, so opening a file never pays for it.
+*/
+void Symbol_reset(void) {
+    for (int i = 0; i < symbolIndex.numSymbols; i++) {
+        char *name = symbolIndex.symbols[i].name;
+        Memory_free(MEMORY_SYMBOLS, name, strlen(name) + 1);
+    }
+
+    Memory_free(MEMORY_SYMBOLS, symbolIndex.symbols, sizeof(struct Symbol) * symbolIndex.capSymbols);
+    symbolIndex.symbols = NULL;
+    symbolIndex.numSymbols = 0;
+    symbolIndex.capSymbols = 0;
+    symbolIndex.built = 0;
+}
+
+void Symbol_buildIndex(void) {
+    if (picker.numPaths == 0 && editorConfig.filename) {
+        Picker_addPath(editorConfig.filename);
+    }
+
+    Progress_begin("Indexing", picker.numPaths, 1);
+    for (int i = 0; i < picker.numPaths && !Progress_update(i); i++) {
+        Symbol_scanFile(picker.paths[i], i);
+    }
+
+    // Start over next time rather than keep half an index.
+    if (Progress_end()) {
+        Symbol_reset();
+        Editor_setStatusMessage("Indexing cancelled");
+        return;
+    }
+
+    qsort(symbolIndex.symbols, symbolIndex.numSymbols, sizeof(struct Symbol), Symbol_compare);
+    symbolIndex.built = 1;
+}
+
+struct Symbol *Symbol_lookup(const char *name) {
+    if (!symbolIndex.built) Symbol_buildIndex();
+    if (symbolIndex.numSymbols == 0) return NULL;
+
+    struct Symbol key = {(char *) name, NULL, 0};
+    struct Symbol *sym = bsearch(&key, symbolIndex.symbols, symbolIndex.numSymbols,
+                                 sizeof(struct Symbol), Symbol_compare);
+    if (!sym) return NULL;
+
+    /* `bsearch` may land anywhere in a run of equal names; take the first. */
+    while (sym > symbolIndex.symbols && strcmp(sym[-1].name, name) == 0) sym--;
+    return sym;
+}
+
+/*
+    Jump to the definition of the identifier under the cursor.
+*/
+void Editor_gotoDefinition(void) {
+    if (editorConfig.cy >= editorConfig.numRows) return;
+
+    int size = editorConfig.row.size[editorConfig.cy];
+    char *chars = Editor_rowChars(editorConfig.cy);
+    if (!chars) return;
+
+    int start = editorConfig.cx;
+    int end = editorConfig.cx;
+    if (start > size) return;
+
+    while (start > 0 && Symbol_isIdent((unsigned char) chars[start - 1])) start--;
+    while (end < size && Symbol_isIdent((unsigned char) chars[end])) end++;
+
+    char name[128];
+    if (end - start <= 0 || end - start >= (int) sizeof(name)) return;
+
+    memcpy(name, &chars[start], end - start);
+    name[end - start] = '\0';
+
+    struct Symbol *sym = Symbol_lookup(name);
+    if (!sym) return;
+
+    int otherFile = !editorConfig.filename || strcmp(sym->path, editorConfig.filename) != 0;
+    if (otherFile && editorConfig.dirty) {
+        Editor_setStatusMessage("Unsaved changes, save before jumping to %s", sym->path);
+        return;
+    }
+
+    // The file may be gone since it was indexed.
+    if (otherFile && Editor_open((char *) sym->path) == -1) {
+        Editor_setStatusMessage("Can't open %s: %s", sym->path, strerror(errno));
+        return;
+    }
+
+    if (sym->line < editorConfig.numRows) {
+        editorConfig.cy = sym->line;
+        editorConfig.cx = 0;
+    }
+}
+
+/*
+    Keep the cursor on the screen by moving the window over the file when
+    the cursor goes past one of its edges.
+*/
+void Editor_scroll(void) {
+    Gutter_updateWidth();
+
+    if (editorConfig.cy < editorConfig.rowOff) {
+        editorConfig.rowOff = editorConfig.cy;
+    }
+
+    if (editorConfig.cy >= editorConfig.rowOff + editorConfig.screenRows) {
+        editorConfig.rowOff = editorConfig.cy - editorConfig.screenRows + 1;
+    }
+
+    if (editorConfig.cx < editorConfig.colOff) {
+        editorConfig.colOff = editorConfig.cx;
+    }
+
+    if (editorConfig.cx >= editorConfig.colOff + editorConfig.screenCols) {
+        editorConfig.colOff = editorConfig.cx - editorConfig.screenCols + 1;
+    }
+}
+
+/*
+    Ask the kernel to start reading the rows the user is scrolling towards.
+
+    Only evicted rows are read from the file when drawn, so this matters in
+    `--max-memory` mode, where scrolling through a cold file on slow storage
+    would otherwise wait on a read for every new row. We look a few frames
+    ahead at the current scrolling speed, at least one screen, in the
+    direction of the scroll. `POSIX_FADV_WILLNEED` returns right away and the
+    read happens in the background.
+*/
+void Editor_readahead(void) {
+    int delta = editorConfig.rowOff - editorConfig.lastRowOff;
+    editorConfig.lastRowOff = editorConfig.rowOff;
+
+    if (delta == 0 || !editorConfig.maxMemory || editorConfig.fd == -1) return;
+
+    int speed = abs(delta);
+    if (speed > editorConfig.screenRows * 4) {
+        // A jump, not a scroll: don't let it skew the speed.
+        editorConfig.scrollSpeed = 0;
+        return;
+    }
+
+    editorConfig.scrollSpeed = (editorConfig.scrollSpeed + speed) / 2;
+
+    int ahead = editorConfig.scrollSpeed * 8;
+    if (ahead < editorConfig.screenRows) ahead = editorConfig.screenRows;
+
+    int from, to;
+    if (delta > 0) {
+        from = editorConfig.rowOff + editorConfig.screenRows;
+        to = from + ahead;
+    } else {
+        to = editorConfig.rowOff;
+        from = to - ahead;
+    }
+
+    if (from < 0) from = 0;
+    if (to > editorConfig.numRows) to = editorConfig.numRows;
+    if (from >= to) return;
+
+    if (from >= editorConfig.readaheadFrom && to <= editorConfig.readaheadTo) return;
+    editorConfig.readaheadFrom = from;
+    editorConfig.readaheadTo = to;
+
+    off_t start = editorConfig.row.offset[from];
+    off_t end = editorConfig.row.offset[to - 1] + editorConfig.row.size[to - 1];
+    posix_fadvise(editorConfig.fd, start, end - start, POSIX_FADV_WILLNEED);
+}
+
+void Editor_drawRows(struct AppendBuffer *ab) {
+    Editor_loadRows(editorConfig.rowOff, editorConfig.rowOff + editorConfig.screenRows);
+
+    for (int y = 0; y < editorConfig.screenRows; y++) {
+        int fileRow = y + editorConfig.rowOff;
+
+        if (fileRow < editorConfig.numRows) {
+            if (gutter.mode != GUTTER_OFF) Gutter_draw(ab, fileRow);
+
+            int len = editorConfig.row.size[fileRow] - editorConfig.colOff;
+            if (len < 0) len = 0;
+            if (len > editorConfig.screenCols) {
+                len = editorConfig.screenCols;
+            }
+
+            // A row that can't be read back is drawn empty.
+            const char *chars = Editor_rowChars(fileRow);
+            if (!chars) len = 0;
+
+            if (len && (spell.enabled || plugins.numRenderers)) {
+                int size = editorConfig.row.size[fileRow];
+
+                if (spell.enabled) Spell_decorate(fileRow, chars, size);
+                Plugin_decorate(fileRow, chars, size);
+                Decorations_draw(ab, chars, editorConfig.colOff, len);
+            } else if (len) {
+                AppendBuffer_append(ab, chars + editorConfig.colOff, len);
+            }
+        } else if (editorConfig.numRows == 0 && y == editorConfig.screenRows / 3) {
+            char welcome[80];
+            int welcomeLen = snprintf(welcome, sizeof(welcome), "Memori editor -- version %s", MEMORI_VERSION);
+
+            if (welcomeLen > editorConfig.screenCols) {
+                welcomeLen = editorConfig.screenCols;
+            }
+
+            int padding = (editorConfig.screenCols - welcomeLen) / 2;
+            if (padding) {
+                AppendBuffer_append(ab, "~", 1);
+                padding--;
+            }
+
+            while (padding--) AppendBuffer_append(ab, " ", 1);
+
+            AppendBuffer_append(ab, welcome, welcomeLen);
+        } else {
+            AppendBuffer_append(ab, "~", 1);
+        }
+
+        // The `K` (Erase In Line) escape sequence. With default argument (0), 
+        // it erase the whole line after cursor
+        AppendBuffer_append(ab, "\x1b[K", 3);
+        if (overview.enabled) Overview_draw(ab, y);
+        AppendBuffer_append(ab, "\r\n", 2);
+    }
+}
+
+/*
+    Draw the message bar, the last line of the screen. A message goes away
+    5 seconds after it was set.
+*/
+void Editor_drawMessageBar(struct AppendBuffer *ab) {
+    AppendBuffer_append(ab, "\x1b[K", 3);
+
+    char counts[128];
+    int countsLen = textStats.shown ? Stats_format(counts, sizeof(counts)) : 0;
+    if (countsLen >= editorConfig.screenCols) countsLen = 0;
+
+    int len = strlen(editorConfig.statusMessage);
+    if (time(NULL) - editorConfig.statusMessageTime >= STATUS_MESSAGE_SECONDS) len = 0;
+    if (len > editorConfig.screenCols - countsLen - 1) len = editorConfig.screenCols - countsLen - 1;
+    if (len < 0) len = 0;
+
+    AppendBuffer_append(ab, editorConfig.statusMessage, len);
+
+    // The counts go to the right end.
+    if (countsLen) {
+        while (len++ < editorConfig.screenCols - countsLen) AppendBuffer_append(ab, " ", 1);
+        AppendBuffer_append(ab, counts, countsLen);
+    }
+}
+
+/*
+    Refresh the screen on every render.
+
+    The refresh steps are:
+
+    1. it hides the cursor with the `l` (Set Mode) espace sequence and 
+    set cursor position to the top;
+    2. Draw all rows;
+    3. Go back to the top and shows the cursor with `h` (Reset Mode) escape sequence.
+*/
+void Editor_refreshScreen(void) {
+    Plugin_newFrame();
+    Editor_scroll();
+    Editor_readahead();
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+
+    AppendBuffer_append(&ab, "\x1b[?25l", 6);
+    AppendBuffer_append(&ab, "\x1b[H", 3);
+
+    Editor_drawRows(&ab);
+    Editor_drawMessageBar(&ab);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorConfig.cy - editorConfig.rowOff + 1,
+             gutter.width + editorConfig.cx - editorConfig.colOff + 1);
+    AppendBuffer_append(&ab, buf, strlen(buf));
+
+    AppendBuffer_append(&ab, "\x1b[?25h", 6);
+
+    write(STDOUT_FILENO, ab.buf, ab.len);
+    AppendBuffer_free(&ab);
+}
+
+/*
+    Redraw what is on the screen, the picker or the editor, for work done
+    while waiting for a key.
+*/
+void Editor_redraw(void) {
+    if (picker.active) {
+        Picker_refreshScreen();
+    } else {
+        Editor_refreshScreen();
+    }
+}
+
+/*
+    Read a line of input in the message bar, showing `prompt` before it.
+
+    Returns the line, which the caller must free, or NULL if the user
+    pressed `ESC`.
+*/
+char *Editor_prompt(const char *prompt) {
+    size_t cap = 128;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    if (!buf) Terminal_die("malloc");
+    buf[0] = '\0';
+
+    while (1) {
+        // The prompt stays until answered.
+        Editor_setStatusMessage("%s%s", prompt, buf);
+        editorConfig.statusMessageTime = LONG_MAX;
+        Timer_cancel(&statusMessageTimer);
+        Editor_refreshScreen();
+
+        int key = Terminal_readKey();
+        if (key == '\x1b') {
+            Editor_setStatusMessage("");
+            free(buf);
+            return NULL;
+        } else if (key == BACKSPACE || key == CTRL_KEY('h') || key == DELETE_KEY) {
+            if (len > 0) buf[--len] = '\0';
+        } else if (key == '\r') {
+            Editor_setStatusMessage("");
+            return buf;
+        } else if (key < 128 && isprint(key)) {
+            if (len == cap - 1) {
+                cap *= 2;
+                char *new = realloc(buf, cap);
+                if (!new) Terminal_die("realloc");
+                buf = new;
+            }
+
+            buf[len++] = key;
+            buf[len] = '\0';
+        }
+    }
+}
+
+/*
+    Show where the memory goes, as `tag live/peak` pairs.
+*/
+void Editor_showMemory(void) {
+    char msg[sizeof(editorConfig.statusMessage)];
+    int len = 0;
+
+    for (int i = 0; i < MEMORY_TAG_COUNT && len < (int) sizeof(msg); i++) {
+        char live[16], peak[16];
+        Memory_formatSize(live, sizeof(live), memoryStats[i].live);
+        Memory_formatSize(peak, sizeof(peak), memoryStats[i].peak);
+
+        len += snprintf(&msg[len], sizeof(msg) - len, "%s%s %s/%s",
+                        i ? " " : "", memoryTagNames[i], live, peak);
+    }
+
+    Editor_setStatusMessage("%s", msg);
+}
+
+/*
+    Write the full memory statistics to a file, since the terminal belongs
+    to the editor. Triggered by `SIGUSR2`.
+*/
+void Editor_dumpMemory(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir) dir = "/tmp";
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/memori-%d.mem", dir, (int) getpid());
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        Editor_setStatusMessage("Can't write memory stats: %s", strerror(errno));
+        return;
+    }
+
+    Memory_dump(fp);
+    fclose(fp);
+    Editor_setStatusMessage("Memory stats written to %s", path);
+}
+
+void Editor_runCommand(const char *command) {
+    if (strcmp(command, "mem") == 0) {
+        Editor_showMemory();
+    } else if (strcmp(command, "w") == 0) {
+        Editor_save();
+    } else if (strcmp(command, "overview") == 0) {
+        Overview_toggle();
+    } else if (strcmp(command, "spell") == 0) {
+        Spell_toggle(NULL);
+    } else if (strncmp(command, "spell ", 6) == 0) {
+        Spell_toggle(command + 6);
+    } else if (strcmp(command, "share") == 0) {
+        Collab_share(NULL);
+    } else if (strncmp(command, "share ", 6) == 0) {
+        Collab_share(command + 6);
+    } else if (Collab_active() && (strncmp(command, "reflow", 6) == 0 || strncmp(command, "json", 4) == 0)) {
+        Editor_setStatusMessage("Can't rewrite the buffer while sharing");
+    } else if (strcmp(command, "jsonpretty") == 0) {
+        Editor_jsonPrettyCommand("");
+    } else if (strncmp(command, "jsonpretty ", 11) == 0) {
+        Editor_jsonPrettyCommand(command + 11);
+    } else if (strcmp(command, "jsonminify") == 0) {
+        Editor_json(0, 0);
+    } else if (strncmp(command, "reflowall", 9) == 0 && (!command[9] || command[9] == ' ')) {
+        Editor_reflowCommand(command[9] ? command + 10 : "", 1);
+    } else if (strncmp(command, "reflow", 6) == 0 && (!command[6] || command[6] == ' ')) {
+        Editor_reflowCommand(command[6] ? command + 7 : "", 0);
+    } else if (strcmp(command, "plugins") == 0) {
+        Plugin_show();
+    } else if (strcmp(command, "count") == 0) {
+        textStats.shown = !textStats.shown;
+    } else if (strcmp(command, "number") == 0) {
+        Gutter_setMode(gutter.mode == GUTTER_ABSOLUTE ? GUTTER_OFF : GUTTER_ABSOLUTE);
+    } else if (strcmp(command, "relativenumber") == 0) {
+        Gutter_setMode(gutter.mode == GUTTER_RELATIVE ? GUTTER_OFF : GUTTER_RELATIVE);
+    } else if (command[0]) {
+        Editor_setStatusMessage("Unknown command: %s", command);
+    }
+}
+
+/*
+    Sleep until there is input, or something else to do: a timer is due,
+    the kernel reports memory pressure, a signal asked for a memory dump,
+    or the other editor of a shared buffer sent edits. Returns whether
+    there is input.
+*/
+int Editor_waitForInput(void) {
+    // Edits made since the last wait go out as one frame.
+    Collab_flush();
+
+    // `poll` skips the ones that are -1.
+    struct pollfd fds[4] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {editorConfig.pressureFd, POLLPRI, 0},
+        {collab.listenFd, POLLIN, 0},
+        {collab.fd, POLLIN, 0},
+    };
+    int n = poll(fds, 4, Timer_timeout());
+    if (n > 0 && (fds[0].revents & POLLIN)) return 1;
+
+    if (n > 0 && fds[1].revents) Editor_checkMemoryPressure();
+
+    if (n > 0 && (fds[2].revents || fds[3].revents)) {
+        if (fds[2].revents) Collab_accept();
+        if (fds[3].revents) Collab_receive();
+        Editor_redraw();
+    }
+
+    // A signal interrupts the `poll`.
+    if (memoryDumpRequested) {
+        memoryDumpRequested = 0;
+        Editor_dumpMemory();
+        Editor_redraw();
+    }
+
+    Timer_run();
+    return 0;
+}
+
+int Editor_rowSize(int at) {
+    return at < editorConfig.numRows ? editorConfig.row.size[at] : 0;
+}
+
+void Editor_processMoveCursor(int key) {
+    switch (key) {
+    case 'k':
+    case ARROW_UP:
+        if (editorConfig.cy > 0) editorConfig.cy--;
+        break;
+    case 'j':
+    case ARROW_DOWN:
+        if (editorConfig.cy < editorConfig.numRows) editorConfig.cy++;
+        break;
+    case 'l':
+    case ARROW_RIGHT:
+        if (editorConfig.cx < Editor_rowSize(editorConfig.cy)) editorConfig.cx++;
+        break;
+    case 'h':
+    case ARROW_LEFT:
+        if (editorConfig.cx > 0) editorConfig.cx--;
+        break;
+    }
+
+    // Moving to a shorter row puts the cursor at its end.
+    int size = Editor_rowSize(editorConfig.cy);
+    if (editorConfig.cx > size) editorConfig.cx = size;
+}
+
+/*
+    Keys of insert mode, which go to the text. `ESC` goes back to normal
+    mode.
+*/
+void Editor_processInsertKey(int key) {
+    if (Collab_active() && Collab_editKey(key)) return;
+
+    switch (key) {
+    case '\x1b':
+        editorConfig.mode = MODE_NORMAL;
+        Editor_setStatusMessage("");
+        break;
+
+    case '\r':
+        Editor_insertNewline();
+        break;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+        Editor_deleteChar();
+        break;
+
+    case DELETE_KEY:
+        if (editorConfig.cx < Editor_rowSize(editorConfig.cy)) {
+            editorConfig.cx++;
+            Editor_deleteChar();
+        }
+        break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_RIGHT:
+    case ARROW_LEFT:
+        Editor_processMoveCursor(key);
+        break;
+
+    default:
+        if (key == '\t' || (key < 128 && isprint(key))) Editor_insertChar(key);
+        break;
+    }
+}
+
+void Editor_processKey(void) {
+    static int quitConfirm = 0;
+    int key = Terminal_readKey();
+
+    if (key == CTRL_KEY('q') && editorConfig.dirty && !quitConfirm) {
+        Editor_setStatusMessage("Unsaved changes. Press Ctrl-Q again to quit anyway");
+        quitConfirm = 1;
+        return;
+    }
+    quitConfirm = 0;
+
+    switch (key) {
+    case CTRL_KEY('q'):
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+
+        exit(0);
+        break;
+
+    case CTRL_KEY('s'):
+        Editor_save();
+        return;
+    }
+
+    if (editorConfig.mode == MODE_INSERT) {
+        switch (key) {
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+            break;
+
+        default:
+            Editor_processInsertKey(key);
+            return;
+        }
+    }
+
+    if (editorConfig.mode == MODE_NORMAL && Plugin_key(key)) return;
+
+    switch (key) {
+    case 'i':
+        editorConfig.mode = MODE_INSERT;
+        Editor_setStatusMessage("-- INSERT --");
+        break;
+
+    case 'x':
+        if (Collab_active()) {
+            Collab_editKey(DELETE_KEY);
+        } else if (editorConfig.cx < Editor_rowSize(editorConfig.cy)) {
+            Editor_rowDeleteChar(editorConfig.cy, editorConfig.cx);
+        }
+        break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+        {
+            int times = editorConfig.screenRows;
+            while (times--) {
+                Editor_processMoveCursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            }
+        }
+        break;
+    
+    case HOME_KEY:
+        editorConfig.cx = 0;
+        break;
+
+    case END_KEY:
+        editorConfig.cx = Editor_rowSize(editorConfig.cy);
+        break;
+
+    case CTRL_KEY(']'):
+        Editor_gotoDefinition();
+        break;
+
+    case 'w':
+        Editor_wordForward();
+        break;
+
+    case 'e':
+        Editor_wordEnd();
+        break;
+
+    case 'b':
+        Editor_wordBackward();
+        break;
+
+    case '}':
+    case '{':
+        Editor_paragraphMove(key == '}' ? 1 : -1);
+        break;
+
+    case ':':
+        {
+            char *command = Editor_prompt(":");
+            if (command) {
+                Editor_runCommand(command);
+                free(command);
+            }
+        }
+        break;
+
+    case 'k':
+    case 'j':
+    case 'l':
+    case 'h':
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_RIGHT:
+    case ARROW_LEFT:
+        Editor_processMoveCursor(key);
+        break;
+    }
+}
+
+void Editor_init(void) {
+    editorConfig.cx = 0;
+    editorConfig.cy = 0;
+    editorConfig.rowOff = 0;
+    editorConfig.colOff = 0;
+    editorConfig.mode = MODE_NORMAL;
+    editorConfig.numRows = 0;
+    editorConfig.rowCap = 0;
+    editorConfig.maxMemory = 0;
+    editorConfig.hugePages = 0;
+    editorConfig.populate = 0;
+    editorConfig.intern = 0;
+    editorConfig.row.size = NULL;
+    editorConfig.row.offset = NULL;
+    editorConfig.indexMap = NULL;
+    editorConfig.shareIndex = 1;
+    editorConfig.row.chars = NULL;
+    editorConfig.row.flags = NULL;
+    editorConfig.filename = NULL;
+    editorConfig.fd = -1;
+    editorConfig.dirty = 0;
+    editorConfig.shiftedFrom = INT_MAX;
+    editorConfig.dirtyChunks = NULL;
+    editorConfig.numDirtyChunks = 0;
+    editorConfig.capDirtyChunks = 0;
+    editorConfig.crlf = 0;
+    editorConfig.trailingNewline = 1;
+    editorConfig.evictHand = 0;
+    editorConfig.pressureFd = -1;
+    editorConfig.lastRowOff = 0;
+    editorConfig.scrollSpeed = 0;
+    editorConfig.readaheadFrom = editorConfig.readaheadTo = 0;
+    editorConfig.statusMessage[0] = '\0';
+    editorConfig.statusMessageTime = 0;
+}
+
+void Editor_initScreen(void) {
+    if (Terminal_getWindowSize(&editorConfig.screenRows, &editorConfig.screenCols) == -1) {
+        Terminal_die("getWindowSize");
+    }
+
+    // Leave the last line to the message bar.
+    editorConfig.screenRows -= 1;
+}
+
+/* Training workload */
+
+/*
+    `--train` runs a headless session over generated files: it opens them
+    (plain, interned and under a memory budget), scrolls through them
+    rendering every frame to memory, searches with the picker and the symbol
+    index, then edits and saves. It is what `make pgo` profiles, so it
+    should follow what people actually do with the editor; keep it in step
+    when adding features.
+*/
+#define TRAIN_ROWS 200000
+#define TRAIN_FILES 2000
+
+unsigned int trainSeed = 1;
+
+/* A small LCG, so every training run does exactly the same thing. */
+unsigned int Train_random(void) {
+    trainSeed = trainSeed * 1103515245 + 12345;
+    return (trainSeed >> 16) & 0x7fff;
+}
+
+double Train_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void Train_report(const char *phase, double start) {
+    printf("%-8s %8.3fs\n", phase, Train_now() - start);
+    fflush(stdout);
+}
+
+/*
+    Write a log with `rows` rows, mostly repeated heartbeats with some
+    unique requests in between, like the logs the editor is used on.
+*/
+void Train_writeLog(const char *path, int rows) {
+    static const char *levels[] = {"INFO", "WARN", "ERROR", "DEBUG"};
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) Terminal_die("fopen");
+
+    for (int i = 0; i < rows; i++) {
+        if (Train_random() % 10 < 7) {
+            fprintf(fp, "2024-01-01T00:00:00Z INFO heartbeat ok\n");
+        } else {
+            fprintf(fp, "2024-01-01T%02d:%02d:%02dZ %s request id=%d took %ums path=/api/v1/items/%u\n",
+                    i / 3600 % 24, i / 60 % 60, i % 60, levels[Train_random() % 4], i,
+                    Train_random() % 1000, Train_random());
+        }
+    }
+
+    fclose(fp);
+}
+
+/*
+    Write a tree of small C files for the picker and the symbol index.
+*/
+void Train_writeTree(const char *dir) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < TRAIN_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/mod%d", dir, i % 20);
+        mkdir(path, 0700);
+
+        snprintf(path, sizeof(path), "%s/mod%d/file_%d.c", dir, i % 20, i);
+        FILE *fp = fopen(path, "w");
+        if (!fp) Terminal_die("fopen");
+
+        fprintf(fp, "#define FILE_%d_MAX %d\n\nstruct Item%d {\n    int id;\n} item%d;\n\n", i, i, i, i);
+        for (int f = 0; f < 5; f++) {
+            fprintf(fp, "int Module%d_function%d(int arg) {\n    return arg + %d;\n}\n\n", i, f, f);
+        }
+        fclose(fp);
+    }
+}
+
+/*
+    Scroll through the open file `frames` times, `step` rows at a time,
+    rendering each frame like the main loop does, but to memory.
+*/
+void Train_scroll(int frames, int step) {
+    for (int i = 0; i < frames; i++) {
+        for (int s = 0; s < step; s++) {
+            Editor_processMoveCursor(i < frames / 2 ? ARROW_DOWN : ARROW_UP);
+        }
+
+        Editor_scroll();
+        Editor_readahead();
+
+        struct AppendBuffer ab = APPEND_BUFFER_INIT;
+        Editor_drawRows(&ab);
+        Editor_drawMessageBar(&ab);
+        AppendBuffer_free(&ab);
+    }
+}
+
+/*
+    Type, split and join rows at random places, then save. Half of the
+    edits keep the row length, to exercise both ways of saving.
+*/
+void Train_edit(int edits) {
+    for (int i = 0; i < edits; i++) {
+        editorConfig.cy = Train_random() * 32768 % editorConfig.numRows;
+        editorConfig.cx = Editor_rowSize(editorConfig.cy) / 2;
+
+        Editor_rowDeleteChar(editorConfig.cy, editorConfig.cx);
+        Editor_processInsertKey('#');
+
+        if (i % 2) {
+            const char *typed = "fixed ";
+            for (int c = 0; typed[c]; c++) Editor_processInsertKey(typed[c]);
+            Editor_processInsertKey('\r');
+            Editor_processInsertKey(BACKSPACE);
+        }
+
+        if (i % 100 == 99) Editor_save();
+    }
+
+    Editor_save();
+}
+
+/*
+    Move by words and paragraphs from random rows, as reading code does.
+*/
+void Train_motions(int moves) {
+    for (int i = 0; i < moves; i++) {
+        editorConfig.cy = Train_random() * 32768 % editorConfig.numRows;
+        editorConfig.cx = 0;
+
+        for (int m = 0; m < 20; m++) Editor_wordForward();
+        for (int m = 0; m < 10; m++) Editor_wordEnd();
+        for (int m = 0; m < 20; m++) Editor_wordBackward();
+        Editor_paragraphMove(i % 2 ? 1 : -1);
+    }
+}
+
+/*
+    Scroll with spell checking on, against a word list of most of the
+    words in the log.
+*/
+void Train_spell(const char *dir) {
+    static const char *words[] = {"info", "warn", "error", "debug", "heartbeat", "ok", "request", "took"};
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/words", dir);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) Terminal_die("fopen");
+    for (unsigned int i = 0; i < sizeof(words) / sizeof(words[0]); i++) fprintf(fp, "%s\n", words[i]);
+    fclose(fp);
+
+    Spell_toggle(path);
+    Train_scroll(2000, 50);
+    Spell_toggle(NULL);
+    unlink(path);
+}
+
+/*
+    Compute the overview of the open file, the way idle time would.
+*/
+void Train_overview(void) {
+    Overview_toggle();
+
+    for (int i = 0; i < overview.numBuckets; i++) {
+        while (overview.buckets[i].dirty) Overview_step();
+    }
+
+    Train_scroll(100, 50);
+    Overview_toggle();
+}
+
+/*
+    Reflow the whole file, then the paragraph at a few places at another
+    width. A log has no blank rows, so the paragraph is the whole file.
+*/
+void Train_reflow(int times) {
+    Editor_reflowCommand("100", 1);
+
+    for (int i = 0; i < times; i++) {
+        editorConfig.cy = Train_random() * 32768 % editorConfig.numRows;
+        Editor_reflowCommand(i % 2 ? "60" : "100", 0);
+    }
+}
+
+/*
+    Write one line of JSON, an array of `items` objects, then pretty-print
+    and minify it back.
+*/
+void Train_json(const char *dir, int items) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/train.json", dir);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) Terminal_die("fopen");
+    fputc('[', fp);
+    for (int i = 0; i < items; i++) {
+        fprintf(fp, "%s{\"id\":%d,\"path\":\"/api/v1/items/%u\",\"tags\":[\"a\",\"b \\\"c\\\"\"],\"ok\":%s,\"took\":{\"ms\":%u}}",
+                i ? "," : "", i, Train_random(), i % 2 ? "true" : "false", Train_random() % 1000);
+    }
+    fputs("]\n", fp);
+    fclose(fp);
+
+    if (Editor_open(path) == -1) Terminal_die("fopen");
+    Editor_json(1, JSON_DEFAULT_INDENT);
+    Train_scroll(2000, 50);
+    Editor_json(0, 0);
+    unlink(path);
+}
+
+void Train_search(const char *dir) {
+    static const char *queries[] = {"mod1file", "file_99", "m3f12c", "zzz", "mod/file_1"};
+
+    Picker_addArg(dir);
+    for (unsigned int q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        for (int i = 0; queries[q][i]; i++) {
+            picker.query[picker.queryLen++] = queries[q][i];
+            picker.query[picker.queryLen] = '\0';
+            Picker_filter(i > 0);
+        }
+
+        while (picker.queryLen > 0) {
+            picker.query[--picker.queryLen] = '\0';
+            Picker_filter(0);
+        }
+    }
+
+    char name[64];
+    int found = 0;
+    for (int i = 0; i < TRAIN_FILES * 5; i++) {
+        snprintf(name, sizeof(name), "Module%d_function%d", Train_random() % TRAIN_FILES, i % 5);
+        if (Symbol_lookup(name)) found++;
+    }
+
+    if (found != TRAIN_FILES * 5) {
+        fprintf(stderr, "train: found %d of %d symbols\n", found, TRAIN_FILES * 5);
+    }
+}
+
+void Train_removeTree(const char *dir) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < TRAIN_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/mod%d/file_%d.c", dir, i % 20, i);
+        unlink(path);
+    }
+
+    for (int i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "%s/mod%d", dir, i);
+        rmdir(path);
+    }
+}
+
+int Train_run(void) {
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp) tmp = "/tmp";
+
+    char dir[PATH_MAX], log[PATH_MAX + 16];
+    snprintf(dir, sizeof(dir), "%s/memori-train.XXXXXX", tmp);
+    if (!mkdtemp(dir)) Terminal_die("mkdtemp");
+    snprintf(log, sizeof(log), "%s/train.log", dir);
+
+    Editor_init();
+    editorConfig.screenRows = 50;
+    editorConfig.screenCols = 160;
+    Gutter_setMode(GUTTER_RELATIVE);
+
+    double start = Train_now();
+    Train_writeLog(log, TRAIN_ROWS);
+    Train_writeTree(dir);
+    Train_report("generate", start);
+
+    start = Train_now();
+    if (Editor_open(log) == -1) Terminal_die("fopen");
+    Train_scroll(2000, 50);
+    Train_report("open", start);
+
+    start = Train_now();
+    Train_overview();
+    Train_report("overview", start);
+
+    start = Train_now();
+    Train_motions(1000);
+    Train_report("motions", start);
+
+    start = Train_now();
+    Train_spell(dir);
+    Train_report("spell", start);
+
+    start = Train_now();
+    Train_edit(1000);
+    Train_report("edit", start);
+
+    start = Train_now();
+    editorConfig.intern = 1;
+    editorConfig.maxMemory = 12 << 20;
+    if (Editor_open(log) == -1) Terminal_die("fopen");
+    Train_scroll(2000, 50);
+    Train_edit(100);
+    editorConfig.intern = 0;
+    editorConfig.maxMemory = 0;
+    Train_report("budget", start);
+
+    start = Train_now();
+    Train_search(dir);
+    Train_report("search", start);
+
+    start = Train_now();
+    if (Editor_open(log) == -1) Terminal_die("fopen");
+    Train_reflow(4);
+    Train_report("reflow", start);
+
+    start = Train_now();
+    Train_json(dir, 100000);
+    Train_report("json", start);
+
+    Editor_freeRows();
+    unlink(log);
+    Train_removeTree(dir);
+    rmdir(dir);
+    return 0;
+}
+
+/*
+    Parse a size like `512K`, `64M` or `2G`. Returns 0 on a malformed size.
+*/
+size_t Editor_parseSize(const char *s) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    switch (toupper((unsigned char) *end)) {
+    case 'G': n <<= 10; /* fall through */
+    case 'M': n <<= 10; /* fall through */
+    case 'K': n <<= 10; end++; break;
+    }
+
+    if (end == s || *end != '\0') return 0;
+    return n;
+}
+
+/* Library API */
+
+/*
+    The `Memori_` functions of `memori.h`, over the same buffer the editor
+    uses. `make libmemori.a` builds this file with `MEMORI_LIBRARY`, which
+    leaves `main` out, and with every other symbol local to the object.
+*/
+int Memori_open(const char *path, const struct MemoriOptions *options) {
+    static int initialized = 0;
+    if (!initialized) {
+        Cpu_init(CPU_LEVEL_COUNT - 1);
+        Editor_init();
+        initialized = 1;
+    }
+
+    struct MemoriOptions old = {editorConfig.maxMemory, editorConfig.intern,
+                                editorConfig.hugePages, editorConfig.populate};
+    struct MemoriOptions none = {0, 0, 0, 0};
+    if (!options) options = &none;
+    editorConfig.maxMemory = options->maxMemory;
+    editorConfig.intern = options->intern;
+    editorConfig.hugePages = options->hugePages;
+    editorConfig.populate = options->populate;
+
+    if (Editor_open((char *) path) == 0) return 0;
+
+    // The buffer still open keeps the options it was opened with.
+    int saved = errno;
+    editorConfig.maxMemory = old.maxMemory;
+    editorConfig.intern = old.intern;
+    editorConfig.hugePages = old.hugePages;
+    editorConfig.populate = old.populate;
+    errno = saved;
+    return -1;
+}
+
+void Memori_close(void) {
+    Editor_freeRows();
+    if (editorConfig.fd != -1) close(editorConfig.fd);
+    editorConfig.fd = -1;
+    free(editorConfig.filename);
+    editorConfig.filename = NULL;
+}
+
+int Memori_numRows(void) {
+    return editorConfig.numRows;
+}
+
+struct MemoriRow Memori_row(int at) {
+    if (at < 0 || at >= editorConfig.numRows) return (struct MemoriRow) {NULL, 0};
+
+    const char *chars = Editor_rowChars(at);
+    if (!chars) return (struct MemoriRow) {NULL, 0};
+    return (struct MemoriRow) {chars, editorConfig.row.size[at]};
+}
+
+int Memori_applyEdits(const struct MemoriEdit *edits, int n) {
+    for (int i = 0; i < n; i++) {
+        const struct MemoriEdit *edit = &edits[i];
+        int row = edit->row;
+
+        switch (edit->kind) {
+        case MEMORI_EDIT_REPLACE:
+            if (row < 0 || row >= editorConfig.numRows || edit->col < 0 || edit->len < 0 ||
+                edit->col + edit->len > editorConfig.row.size[row] || edit->textLen < 0) {
+                return i;
+            }
+            if (Editor_rowReplace(row, edit->col, edit->len, edit->text, edit->textLen) == -1) return i;
+            break;
+
+        case MEMORI_EDIT_INSERT_ROW:
+            if (row < 0 || row > editorConfig.numRows || edit->textLen < 0) return i;
+            Editor_insertRow(row, edit->text, edit->textLen);
+            break;
+
+        case MEMORI_EDIT_DELETE_ROW:
+            if (row < 0 || row >= editorConfig.numRows) return i;
+            Editor_deleteRow(row);
+            break;
+
+        default:
+            return i;
+        }
+    }
+
+    return n;
+}
+
+int Memori_save(void) {
+    Editor_save();
+    return editorConfig.dirty || editorConfig.shiftedFrom != INT_MAX ? -1 : 0;
+}
+
+void Memori_searchBegin(struct MemoriSearch *search, const char *needle, int needleLen) {
+    search->needle = needle;
+    search->needleLen = needleLen;
+    search->row = 0;
+    search->col = -1;
+}
+
+/*
+    Rows shorter than the needle are skipped by their size alone, and the
+    rest are scanned with `memchr` for the first byte, which libc
+    vectorizes.
+*/
+int Memori_searchNext(struct MemoriSearch *search) {
+    int n = search->needleLen;
+    if (n <= 0) return 0;
+
+    for (int at = search->row, from = search->col + 1; at < editorConfig.numRows; at++, from = 0) {
+        int size = editorConfig.row.size[at];
+        if (size - from < n) continue;
+
+        const char *chars = Editor_rowChars(at);
+        if (!chars) {
+            // Stop before this row, so calling again retries it.
+            search->row = at;
+            search->col = from - 1;
+            return -1;
+        }
+
+        const char *p = chars + from, *last = chars + size - n;
+        while (p <= last && (p = memchr(p, search->needle[0], last - p + 1))) {
+            if (memcmp(p, search->needle, n) == 0) {
+                search->row = at;
+                search->col = p - chars;
+                return 1;
+            }
+            p++;
+        }
+    }
+
+    search->row = editorConfig.numRows;
+    search->col = -1;
+    return 0;
+}
+
+char *Memori_render(int rowOff, int colOff, int rows, int cols, size_t *len) {
+    int savedRowOff = editorConfig.rowOff, savedColOff = editorConfig.colOff;
+    int savedRows = editorConfig.screenRows, savedCols = editorConfig.screenCols;
+
+    editorConfig.rowOff = rowOff;
+    editorConfig.colOff = colOff;
+    editorConfig.screenRows = rows;
+    editorConfig.screenCols = cols;
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    Editor_drawRows(&ab);
+
+    editorConfig.rowOff = savedRowOff;
+    editorConfig.colOff = savedColOff;
+    editorConfig.screenRows = savedRows;
+    editorConfig.screenCols = savedCols;
+
+    *len = ab.len;
+    return ab.buf;
+}
+
+void Memori_freeFrame(char *frame, size_t len) {
+    struct AppendBuffer ab = {frame, len};
+    AppendBuffer_free(&ab);
+}
+
+#ifndef MEMORI_LIBRARY
+int main(int argc, char **argv) {
+    size_t maxMemory = 0;
+    int hugePages = 0;
+    int populate = 0;
+    int intern = 0;
+    int shareIndex = 1;
+    const char *attach = NULL;
+    int train = 0;
+    int cpuFeatures = 0;
+    int cpuLevel = CPU_LEVEL_COUNT - 1;
+
+    // A bad option leaves `argi` past `argc`, which shows the usage.
+    int argi = 1;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--max-memory") == 0 && argi + 1 < argc) {
+            maxMemory = Editor_parseSize(argv[argi + 1]);
+            if (!maxMemory) argi = argc;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--hugepages") == 0) {
+            hugePages = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--populate") == 0) {
+            populate = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--intern") == 0) {
+            intern = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--no-shared-index") == 0) {
+            shareIndex = 0;
+            argi++;
+        } else if (strcmp(argv[argi], "--cpu") == 0 && argi + 1 < argc) {
+            cpuLevel = Cpu_parseLevel(argv[argi + 1]);
+            if (cpuLevel == -1) argi = argc;
+            argi += 2;
+        } else if (strcmp(argv[argi], "--cpu-features") == 0) {
+            cpuFeatures = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--plugin") == 0 && argi + 1 < argc) {
+            const char *error = Plugin_load(argv[argi + 1]);
+            if (error) {
+                fprintf(stderr, "%s: can't load plugin %s: %s\n", argv[0], argv[argi + 1], error);
+                return 1;
+            }
+            argi += 2;
+        } else if (strcmp(argv[argi], "--attach") == 0 && argi + 1 < argc) {
+            attach = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--train") == 0) {
+            train = 1;
+            argi++;
+        } else {
+            argi = argc + 1;
+        }
+    }
+
+    if (argi == argc && (cpuFeatures || train)) {
+        Cpu_init(cpuLevel);
+        if (cpuFeatures) Cpu_printFeatures();
+        return train ? Train_run() : 0;
+    }
+
+    if (argi >= argc && !(attach && argi == argc)) {
+        printf("usage: %s [--max-memory <size>] [--hugepages] [--populate] [--intern] [--cpu <level>]\n"
+               "          [--no-shared-index] [--plugin <path>]... <file|directory>...\n"
+               "       %s [--cpu <level>] [--plugin <path>]... --attach <socket>\n"
+               "       %s [--cpu <level>] --cpu-features\n"
+               "       %s [--cpu <level>] --train\n"
+               "levels: scalar, sse2, avx2, avx512\n", argv[0], argv[0], argv[0], argv[0]);
+        return 0;
+    }
+
+    if (attach && Collab_connect(attach) == -1) {
+        fprintf(stderr, "%s: can't attach to %s: %s\n", argv[0], attach, strerror(errno));
+        return 1;
+    }
+
+    Cpu_init(cpuLevel);
+
+    Terminal_enableRawMode();
+    Editor_init();
+    Editor_initScreen();
+    signal(SIGUSR2, Memory_handleSignal);
+
+    editorConfig.hugePages = hugePages;
+    editorConfig.populate = populate;
+    editorConfig.intern = intern;
+    editorConfig.shareIndex = shareIndex;
+
+    if (maxMemory) {
+        editorConfig.maxMemory = maxMemory;
+        Editor_watchMemoryPressure();
+    }
+
+    struct stat st;
+    if (attach) {
+        const char *error = Collab_loadRows();
+        if (error) {
+            Collab_disconnect();
+            Editor_setStatusMessage("Can't attach to %s: %s", attach, error);
+        } else {
+            Editor_setStatusMessage("Attached to %s", attach);
+        }
+    } else if (argc - argi == 1 && (stat(argv[argi], &st) == -1 || !S_ISDIR(st.st_mode))) {
+        if (Editor_open(argv[argi]) == -1) Terminal_die("fopen");
+    } else {
+        for (int i = argi; i < argc; i++) {
+            Picker_addArg(argv[i]);
+        }
+
+        if (Editor_open(Picker_run()) == -1) Terminal_die("fopen");
+    }
+
+    while(1) {
+        Editor_refreshScreen();
+        Editor_processKey();
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,168 @@
+#ifndef MEMORI_H
+#define MEMORI_H
+
+#include <stddef.h>
+
+/*
+    libmemori: the editor's buffer, row index, search and rendering, for
+    tools that want to read, search and edit large files the way memori
+    does, without a terminal. Build it with `make libmemori.a`.
+
+    The editor keeps its state in globals, so there is one buffer per
+    process, and calls must come from one thread at a time. Failures are
+    returned, as below. Only two print a message and exit the process, as
+    in the editor: running out of memory, and io_uring failing while reads
+    into the buffer are still in flight.
+*/
+
+#define MEMORI_API_VERSION 1
+
+#define MEMORI_API __attribute__((visibility("default")))
+
+struct MemoriOptions {
+    /* Memory budget for row contents in bytes, or 0 for none. */
+    size_t maxMemory;
+    /* Share one copy of identical rows. */
+    int intern;
+    /* Back the row table with transparent huge pages. */
+    int hugePages;
+    /* Prefault the whole file while indexing it. */
+    int populate;
+};
+
+/*
+    A row, without its line ending. `chars` points into the buffer itself:
+    it stays valid until the next call that can load a row (under a memory
+    budget, loading one can evict another) or that changes the buffer.
+*/
+struct MemoriRow {
+    const char *chars;
+    int len;
+};
+
+enum MemoriEditKind {
+    /* Replace `len` bytes of `row` from `col` with `text`. */
+    MEMORI_EDIT_REPLACE,
+    /* Insert `text` as a new row before `row`. */
+    MEMORI_EDIT_INSERT_ROW,
+    /* Delete `row`. */
+    MEMORI_EDIT_DELETE_ROW
+};
+
+/* `text` has no line endings, and can't point into the buffer. */
+struct MemoriEdit {
+    enum MemoriEditKind kind;
+    int row;
+    int col;
+    int len;
+    const char *text;
+    int textLen;
+};
+
+/*
+    Where a search is. Set up by `Memori_searchBegin`; after each match,
+    `row` and `col` are where it was found.
+*/
+struct MemoriSearch {
+    const char *needle;
+    int needleLen;
+    int row;
+    int col;
+};
+
+/*
+    Open `path`, replacing the buffer. Returns -1 with `errno` set on
+    failure, leaving the buffer as it was.
+*/
+MEMORI_API int Memori_open(const char *path, const struct MemoriOptions *options);
+MEMORI_API void Memori_close(void);
+
+MEMORI_API int Memori_numRows(void);
+/*
+    Row `at`, or `{NULL, 0}` past the end, or with `errno` set when the row
+    was evicted and can't be read back (the file was truncated under us).
+*/
+MEMORI_API struct MemoriRow Memori_row(int at);
+
+/*
+    Apply `n` edits in order. Returns `n`, or the index of the first edit
+    out of range or on a row that can't be read back, which and the ones
+    after it aren't applied.
+*/
+MEMORI_API int Memori_applyEdits(const struct MemoriEdit *edits, int n);
+/*
+    Write the changes back to the file. Returns -1 if they weren't saved:
+    with `errno` set on an I/O error, or when the file changed on disk
+    since it was opened.
+*/
+MEMORI_API int Memori_save(void);
+
+/* Search for the `needleLen` bytes at `needle`, from the start. */
+MEMORI_API void Memori_searchBegin(struct MemoriSearch *search, const char *needle, int needleLen);
+/*
+    Find the next match, returning 0 when there are no more, or -1 with
+    `errno` set when a row can't be read back; calling it again retries
+    that row.
+*/
+MEMORI_API int Memori_searchNext(struct MemoriSearch *search);
+
+/*
+    Render `rows` rows of `cols` columns from row `rowOff` and column
+    `colOff`, as the editor draws them, with terminal escapes. Returns the
+    frame and sets `*len`; free it with `Memori_freeFrame`.
+*/
+MEMORI_API char *Memori_render(int rowOff, int colOff, int rows, int cols, size_t *len);
+MEMORI_API void Memori_freeFrame(char *frame, size_t len);
+
+/*
+    Plugins are shared objects loaded with `memori --plugin <path>`. Each
+    exports `Memori_plugin`, returning its hooks; any hook may be NULL.
+
+    Every hook call is timed. A plugin gets 2ms a frame for all its calls:
+    once over, it's skipped for the rest of the frame, and after three such
+    frames it's disabled. `:plugins` shows how each one is doing.
+*/
+#define MEMORI_PLUGIN_VERSION 1
+
+/* Keys `onKey` gets that aren't a byte of their own. */
+enum MemoriKey {
+    MEMORI_KEY_BACKSPACE = 127,
+    MEMORI_KEY_ARROW_LEFT = 1000,
+    MEMORI_KEY_ARROW_RIGHT,
+    MEMORI_KEY_ARROW_UP,
+    MEMORI_KEY_ARROW_DOWN,
+    MEMORI_KEY_PAGE_UP,
+    MEMORI_KEY_PAGE_DOWN,
+    MEMORI_KEY_HOME,
+    MEMORI_KEY_END,
+    MEMORI_KEY_DELETE
+};
+
+/* Draw bytes `[start, end)` of a row with SGR attribute `sgr` (31 is red). */
+struct MemoriSpan {
+    int start;
+    int end;
+    int sgr;
+};
+
+struct MemoriPlugin {
+    /* MEMORI_PLUGIN_VERSION, which the plugin was built against. */
+    int version;
+    const char *name;
+
+    void (*onOpen)(const char *path, int numRows);
+    /* Fill up to `maxSpans` spans for a row being drawn; return how many. */
+    int (*onRowRender)(int row, const char *chars, int len, struct MemoriSpan *spans, int maxSpans);
+    /*
+        A key pressed in normal mode, before the editor sees it: a byte,
+        or one of `enum MemoriKey` for arrows and such. Return nonzero to
+        take the key from the editor.
+    */
+    int (*onKey)(int key);
+    void (*onSave)(const char *path);
+};
+
+/* Defined by each plugin, not by the library. */
+MEMORI_API const struct MemoriPlugin *Memori_plugin(void);
+
+#endif